@@ -23,10 +23,19 @@
 /*
 File system layout onto disk blocks:
 
-Block 0: Master block
+Block 0: Master block (ending in the superblock, see vdisk.h)
 Blocks 1 ... N_INODE_BLOCKS: inodes
 Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
    (Block N_BLOCKS+1 is allocated for the root directory)
+
+A superblock may give other numbers of blocks and inode blocks, and
+another block size.  If the allocation bitmaps of such a disk do not fit
+in MASTER_BLOCK, they take the blocks right after the inodes instead,
+inode bitmap first.
+
+The structures below are sized for blocks of VDISK_MAX_BLOCK_SIZE bytes.
+How many entries of each a block of the open disk holds depends on its
+block size: the *_PER_BLOCK() macros take it as their argument.
 */
 
 /**********************************************************************/
@@ -34,41 +43,100 @@ Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
 // Chosen carefully so that all block types pack nicely into a full block
 
 // An index that refers to an inode
-typedef unsigned short INODE_REFERENCE;
+typedef unsigned int INODE_REFERENCE;
 // Value used as an index when it does not refer to an inode
-#define UNALLOCATED_INODE (USHRT_MAX-1)
+#define UNALLOCATED_INODE (UINT_MAX-1)
 
 // Value used as an index when it does not refer to a block
-#define UNALLOCATED_BLOCK USHRT_MAX
+#define UNALLOCATED_BLOCK UINT_MAX
+
+// References are 32 bits in memory.  On disk they are 32 bits wide with
+//  OUFS_FORMAT_WIDE and 16 bits wide otherwise (NARROW_REFERENCE), where
+//  the two largest values stand for the two markers above.
+typedef unsigned short NARROW_REFERENCE;
+#define NARROW_UNALLOCATED USHRT_MAX
 
-// Number of inode blocks on the virtual disk
+// Most blocks (and inodes) a disk with 16-bit references can have
+#define OUFS_NARROW_MAX_BLOCKS (USHRT_MAX - 1)
+
+// Number of inode blocks on a virtual disk (unless its superblock says otherwise)
 #define N_INODE_BLOCKS 8
 
 // The block on the virtual disk containing the root directory
 #define ROOT_DIRECTORY_BLOCK (N_INODE_BLOCKS + 1)
 
-// Size of file/directory name
-#define FILE_NAME_SIZE (16 - sizeof(INODE_REFERENCE))
+// Size of file/directory name (WIDE_FILE_NAME_SIZE with OUFS_FORMAT_WIDE)
+#define FILE_NAME_SIZE (16 - sizeof(NARROW_REFERENCE))
+#define WIDE_FILE_NAME_SIZE (16 - sizeof(INODE_REFERENCE))
 
 // Number of data block references in an inode.  Just big enough to fit a reasonable
 //  number of inodes into a single block
 #define BLOCKS_PER_INODE (16-1)
 
+// How INODE.data is used by files (recorded in the master block)
+// OUFS_FORMAT_DIRECT: every entry refers to a data block.  Disks formatted
+//  before formats were recorded read as this one.
+// OUFS_FORMAT_INDIRECT: the first N_DIRECT_BLOCKS entries refer to data
+//  blocks, followed by a single-indirect and a double-indirect block
+// OUFS_FORMAT_INLINE: as OUFS_FORMAT_INDIRECT, but files of up to
+//  INLINE_DATA_SIZE bytes may instead keep their contents in INODE.data
+// OUFS_FORMAT_DIRINDEX: as OUFS_FORMAT_INLINE, and a directory that
+//  outgrows its first block gets more blocks and a DIR_INDEX_BLOCK over
+//  the hashes of its names (older formats keep one block per directory)
+// OUFS_FORMAT_WIDE: as OUFS_FORMAT_DIRINDEX, with 32-bit references on
+//  disk (WIDE_INODE, WIDE_DIRECTORY_ENTRY, WIDE_INDIRECT_BLOCK), so that
+//  a disk may have more than OUFS_NARROW_MAX_BLOCKS blocks
+#define OUFS_FORMAT_DIRECT 0
+#define OUFS_FORMAT_INDIRECT 1
+#define OUFS_FORMAT_INLINE 2
+#define OUFS_FORMAT_DIRINDEX 3
+#define OUFS_FORMAT_WIDE 4
+
+#define N_DIRECT_BLOCKS (BLOCKS_PER_INODE - 2)
+#define INDIRECT_INDEX N_DIRECT_BLOCKS
+#define DOUBLE_INDIRECT_INDEX (N_DIRECT_BLOCKS + 1)
+
+// INODE.data[0] of a file whose contents follow it in INODE.data.  They
+//  take the room of the other references on disk: INLINE_DATA_SIZE bytes,
+//  or WIDE_INLINE_DATA_SIZE with OUFS_FORMAT_WIDE.
+#define INLINE_DATA_MARKER (UINT_MAX-1)
+#define INLINE_DATA_SIZE ((BLOCKS_PER_INODE - 1) * sizeof(NARROW_REFERENCE))
+#define WIDE_INLINE_DATA_SIZE ((BLOCKS_PER_INODE - 1) * sizeof(BLOCK_REFERENCE))
+
 /**********************************************************************/
 // Data block: storage for file contents (project 4!)
 typedef struct data_block_s
 {
-  unsigned char data[BLOCK_SIZE];
+  unsigned char data[VDISK_MAX_BLOCK_SIZE];
 } DATA_BLOCK;
 
 
+// Indirect block: references to more blocks of a file
+#define REFERENCES_PER_BLOCK(block_size) ((block_size) / sizeof(NARROW_REFERENCE))
+#define WIDE_REFERENCES_PER_BLOCK(block_size) ((block_size) / sizeof(BLOCK_REFERENCE))
+
+typedef struct indirect_block_s
+{
+  // NARROW_UNALLOCATED means that this entry is not used
+  NARROW_REFERENCE block[REFERENCES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
+} INDIRECT_BLOCK;
+
+typedef struct wide_indirect_block_s
+{
+  // UNALLOCATED_BLOCK means that this entry is not used
+  BLOCK_REFERENCE block[WIDE_REFERENCES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
+} WIDE_INDIRECT_BLOCK;
+
+
 /**********************************************************************/
 // Inode Types
 #define IT_NONE 'N'
 #define IT_DIRECTORY 'D'
 #define IT_FILE 'F'
 
-// Single inode
+// Single inode, as the library works on it.  On disk it is stored as a
+//  NARROW_INODE, or with OUFS_FORMAT_WIDE as a WIDE_INODE (the same
+//  layout as INODE).
 typedef struct inode_s
 {
   // IT_NONE, IT_DIRECTORY, IT_FILE
@@ -84,32 +152,55 @@ typedef struct inode_s
   unsigned int size;
 } INODE;
 
+typedef INODE WIDE_INODE;
+
+typedef struct narrow_inode_s
+{
+  char type;
+  unsigned char n_references;
+  NARROW_REFERENCE data[BLOCKS_PER_INODE];
+  unsigned int size;
+} NARROW_INODE;
+
 // Number of inodes stored in each block
-#define INODES_PER_BLOCK (BLOCK_SIZE/sizeof(INODE))
+#define INODES_PER_BLOCK(block_size) ((block_size) / sizeof(NARROW_INODE))
+#define WIDE_INODES_PER_BLOCK(block_size) ((block_size) / sizeof(WIDE_INODE))
 
-// Total number of inodes in the file system
-#define N_INODES (INODES_PER_BLOCK * N_INODE_BLOCKS)
+// Total number of inodes in a file system with N_INODE_BLOCKS
+#define N_INODES(block_size) (INODES_PER_BLOCK(block_size) * N_INODE_BLOCKS)
 
 // Block of inodes
 typedef struct inode_block_s
 {
-  INODE inode[INODES_PER_BLOCK];
+  NARROW_INODE inode[INODES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
 } INODE_BLOCK;
 
+typedef struct wide_inode_block_s
+{
+  WIDE_INODE inode[WIDE_INODES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
+} WIDE_INODE_BLOCK;
+
 
 /**********************************************************************/
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
 
+// The inode flags have room for N_INODES(), so where the fields after them
+//  start depends on the block size
+#define MASTER_INODE_FLAG_BYTES(block_size) (N_INODES(block_size) >> 3)
+#define MASTER_BLOCK_FLAG_BYTES (N_BLOCKS_IN_DISK >> 3)
+#define MASTER_FORMAT_OFFSET(block_size) \
+  (MASTER_INODE_FLAG_BYTES(block_size) + MASTER_BLOCK_FLAG_BYTES)
+
 typedef struct master_block_s
 {
-  // 8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
-  // The first inode is byte 0, bit 0
-  unsigned char inode_allocated_flag[N_INODES >> 3];
-
-  // 8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
-  // Block 0 (the master block) is byte 0, bit 0
-  unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
+  // MASTER_INODE_FLAG_BYTES: 8 inodes per byte: One inode per bit:
+  //  1 = allocated, 0 = free.  The first inode is byte 0, bit 0
+  // MASTER_BLOCK_FLAG_BYTES: 8 data blocks per byte: One block per bit:
+  //  1 = allocated, 0 = free.  Block 0 (the master block) is bit 0 of
+  //  the first byte
+  // The byte at MASTER_FORMAT_OFFSET: OUFS_FORMAT_*
+  unsigned char flags[VDISK_MAX_BLOCK_SIZE];
 } MASTER_BLOCK;
 
 /**********************************************************************/
@@ -119,41 +210,119 @@ typedef struct directory_entry_s
   // Name of file/directory
   char name[FILE_NAME_SIZE];
 
-  // UNALLOCATED_INODE if this directory entry is non-existent
-  INODE_REFERENCE inode_reference;
+  // UNALLOCATED_INODE (stored as NARROW_UNALLOCATED - 1) if this
+  //  directory entry is non-existent
+  NARROW_REFERENCE inode_reference;
 
 } DIRECTORY_ENTRY;
 
+// With OUFS_FORMAT_WIDE: same size, so both formats keep the same number of
+//  entries per block, at the cost of shorter names
+typedef struct wide_directory_entry_s
+{
+  char name[WIDE_FILE_NAME_SIZE];
+
+  // UNALLOCATED_INODE if this directory entry is non-existent
+  INODE_REFERENCE inode_reference;
+} WIDE_DIRECTORY_ENTRY;
+
 // Number of directory entries stored in one data block
-#define DIRECTORY_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(DIRECTORY_ENTRY))
+#define DIRECTORY_ENTRIES_PER_BLOCK(block_size) ((block_size) / sizeof(DIRECTORY_ENTRY))
 
 // Directory block
 typedef struct directory_block_s
 {
-  DIRECTORY_ENTRY entry[DIRECTORY_ENTRIES_PER_BLOCK];
+  DIRECTORY_ENTRY entry[DIRECTORY_ENTRIES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
 } DIRECTORY_BLOCK;
 
+typedef struct wide_directory_block_s
+{
+  WIDE_DIRECTORY_ENTRY entry[DIRECTORY_ENTRIES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
+} WIDE_DIRECTORY_BLOCK;
+
+// Index over the names of a large directory.  Its blocks are numbered like
+//  the blocks of a file; block 0 is always a directory block (it keeps "."
+//  and ".."), and block DIR_INDEX_ROOT is the root of the index.  Each
+//  record covers the names whose hash is at least its hash, up to the next
+//  record's; the first record's hash is 0.
+#define DIR_INDEX_ROOT 1
+#define DIR_INDEX_RECORDS(block_size) (((block_size) - 8) / 8)
+
+typedef struct dir_index_record_s
+{
+  unsigned int hash;
+
+  // Directory block holding the names (or, from the root of a two-level
+  //  index, the index block covering them)
+  unsigned int block;
+} DIR_INDEX_RECORD;
+
+typedef struct dir_index_block_s
+{
+  unsigned short n_records;
+
+  // Root only: 0 if its records refer to directory blocks, 1 if they
+  //  refer to second-level index blocks
+  unsigned char levels;
+  unsigned char unused;
+
+  // Root only: number of blocks in the directory
+  unsigned int n_blocks;
+
+  DIR_INDEX_RECORD record[DIR_INDEX_RECORDS(VDISK_MAX_BLOCK_SIZE)];
+} DIR_INDEX_BLOCK;
+
 /**********************************************************************/
 // All-encompassing structure for a disk block
-// The union says that all 4 of these elements occupy overlapping bytes in 
-//  memory (hence, a block will only be one of these 4 at any given time)
+// The union says that all 5 of these elements occupy overlapping bytes in 
+//  memory (hence, a block will only be one of these 5 at any given time)
 typedef union block_u
 {
   DATA_BLOCK data;
   MASTER_BLOCK master;
   INODE_BLOCK inodes;
   DIRECTORY_BLOCK directory;
+  INDIRECT_BLOCK indirect;
+  DIR_INDEX_BLOCK dir_index;
+  WIDE_INODE_BLOCK wide_inodes;
+  WIDE_DIRECTORY_BLOCK wide_directory;
+  WIDE_INDIRECT_BLOCK wide_indirect;
 } BLOCK;
 
 
 /**********************************************************************/
 // Representing files (project 4!)
 
+// Indirect blocks last used to map a file's blocks, so that neighbouring
+//  blocks are mapped without reading them again.  Slot 0 holds references
+//  to data blocks, slot 1 the top of the double-indirect tree.
+typedef struct oufs_map_cache_s
+{
+  BLOCK_REFERENCE ref[2];
+  char dirty[2];
+  BLOCK block[2];
+} OUFS_MAP_CACHE;
+
 typedef struct oufile_s
 {
   INODE_REFERENCE inode_reference;
   char mode;
   int offset;
+
+  // Copy of the file's inode, written back by oufs_fflush()
+  INODE inode;
+  char inode_dirty;
+
+  // One data block of the file, so that small reads and writes do not go
+  //  to the disk every time.  buffer_index is the block's index in
+  //  the file and buffer_ref the disk block (-1 if the buffer is empty)
+  int buffer_index;
+  BLOCK_REFERENCE buffer_ref;
+  char buffer_dirty;
+  BLOCK buffer;
+
+  // Indirect blocks of the file
+  OUFS_MAP_CACHE map;
 } OUFILE;
 
 
@@ -1,28 +1,162 @@
 #ifndef OUFS_LIB
 #define OUFS_LIB
+#include <sys/uio.h>
 #include "oufs.h"
 
 #define MAX_PATH_LENGTH 200
 
+// Layout of the open disk, from oufs_get_geometry()
+typedef struct oufs_geometry_s
+{
+  int n_blocks;
+  int n_inode_blocks;
+  int n_inodes;
+
+  // Bytes in a block (1 << block_shift)
+  int block_size;
+  int block_shift;
+
+  // 1 if references are 32 bits on disk (OUFS_FORMAT_WIDE)
+  char wide;
+
+  // What one block holds, given its size and the width of references
+  int inodes_per_block;
+  int entries_per_block;
+  int refs_per_block;
+  int index_records;
+
+  // Size of a name field in a directory entry, and most bytes of a file
+  //  kept in its inode (both depend on the width of references)
+  int name_size;
+  int inline_size;
+
+  // Blocks after the inodes holding the allocation bitmaps (0 if they are
+  //  in the master block), and the bitmaps themselves (in memory)
+  int n_bitmap_blocks;
+  unsigned char *inode_bitmap;
+  unsigned char *block_bitmap;
+} OUFS_GEOMETRY;
+
+// Result of oufs_lookup_parent(): where a name lives, or would live
+typedef struct oufs_lookup_s
+{
+  // Directory that holds (or would hold) the name, and its block (the
+  //  block_index'th of the directory)
+  INODE_REFERENCE parent;
+  int block_index;
+  BLOCK_REFERENCE block_ref;
+  BLOCK block;
+
+  // Final path component, truncated to fit a directory entry
+  char name[FILE_NAME_SIZE];
+
+  // Slot holding the name and the inode it refers to (-1 and
+  //  UNALLOCATED_INODE if the name does not exist)
+  int entry;
+  INODE_REFERENCE child;
+
+  // First unused slot (-1 if the block is full)
+  int free_entry;
+} OUFS_LOOKUP;
+
+// A directory whose blocks are being worked on
+typedef struct dir_context_s
+{
+  INODE_REFERENCE ref;
+  INODE inode;
+  OUFS_MAP_CACHE map;
+} DIR_CONTEXT;
+
+// One entry of a directory, from oufs_readdir()
+typedef struct oufs_dirent_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode_reference;
+
+  // Of the inode the entry refers to: IT_DIRECTORY or IT_FILE, and size
+  //  (bytes for a file, entries for a directory)
+  char type;
+  unsigned int size;
+} OUFS_DIRENT;
+
+// Directory opened by oufs_opendir().  Entries come back in the order they
+//  are stored, one directory block at a time, starting with "." and "..".
+typedef struct oufs_dir_s
+{
+  DIR_CONTEXT context;
+
+  // Directory block being read (valid if loaded), and the next slot in it
+  int block_index;
+  int entry;
+  char loaded;
+  BLOCK block;
+
+  // Last entry returned
+  OUFS_DIRENT dirent;
+} OUFS_DIR;
+
+// Attributes of a file or directory, from oufs_stat() / oufs_stat_dir()
+typedef struct oufs_stat_s
+{
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode_reference;
+
+  // From the inode: IT_DIRECTORY or IT_FILE, link count and size (bytes
+  //  for a file, entries for a directory)
+  char type;
+  unsigned char n_references;
+  unsigned int size;
+} OUFS_STAT;
+
+// Called by oufs_fread_blocks() with the next piece of a file: len bytes
+//  at data, which stay valid until the callback returns.  A nonzero
+//  return value stops the iteration.
+typedef int (*OUFS_BLOCK_CALLBACK)(const unsigned char *data, int len, void *arg);
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name);
 
 // PROJECT 3
 int oufs_format_disk(char  *virtual_disk_name);
+int oufs_format_disk_geometry(char *virtual_disk_name, int n_blocks, int n_inodes,
+                              int block_size, int wide);
+int oufs_get_geometry(OUFS_GEOMETRY *layout);
+int oufs_sync();
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
+int oufs_lookup_parent(char *cwd, char *path, OUFS_LOOKUP *lookup);
 int oufs_mkdir(char *cwd, char *path);
 int oufs_list(char *cwd, char *path);
+OUFS_DIR *oufs_opendir(char *cwd, char *path);
+OUFS_DIRENT *oufs_readdir(OUFS_DIR *dir);
+void oufs_closedir(OUFS_DIR *dir);
+int oufs_stat(char *cwd, char *path, OUFS_STAT *stat);
+int oufs_stat_dir(char *cwd, char *path, OUFS_STAT **stats);
 int oufs_rmdir(char *cwd, char *path);
 
 // Helper functions in oufs_lib_support.c
 void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BLOCK *block);
-void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry);
+void oufs_clean_directory_entry(BLOCK *block, int i);
 BLOCK_REFERENCE oufs_allocate_new_block();
+int oufs_allocate_block_run(int n_blocks, BLOCK_REFERENCE goal, BLOCK_REFERENCE *refs);
 INODE_REFERENCE oufs_allocate_new_inode();
 int oufs_deallocate_block(BLOCK_REFERENCE block_ref);
 int oufs_deallocate_inode(INODE_REFERENCE inode_ref);
+int oufs_bitmap_find_free(unsigned char *bitmap, int n_bits, int start);
+int oufs_bitmap_find_run(unsigned char *bitmap, int n_bits, int len, int start);
+int oufs_bitmap_longest_run(unsigned char *bitmap, int n_bits, int *first);
+void oufs_bitmap_set(unsigned char *bitmap, int first, int len);
+void oufs_bitmap_clear(unsigned char *bitmap, int first, int len);
+void oufs_release_file_blocks(INODE *inode);
+int oufs_max_file_size();
+void oufs_map_init(OUFS_MAP_CACHE *map);
+BLOCK_REFERENCE oufs_map_block(INODE *inode, int index, OUFS_MAP_CACHE *map);
+void oufs_dentry_insert(INODE_REFERENCE parent, char *name, INODE_REFERENCE child);
+void oufs_dentry_purge_directory(INODE_REFERENCE parent);
+void oufs_dentry_reset();
+int oufs_find_directory_entry(BLOCK *block, char *name);
+INODE_REFERENCE oufs_entry_inode(BLOCK *block, int i);
 
 // Helper functions to be provided
 int oufs_find_open_bit(unsigned char value);
@@ -30,8 +164,17 @@ int oufs_find_open_bit(unsigned char value);
 // PROJECT 4 ONLY
 OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
 void oufs_fclose(OUFILE *fp);
+int oufs_fflush(OUFILE *fp);
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
 int oufs_fread(OUFILE *fp, unsigned char *buf, int len);
+int oufs_fwritev(OUFILE *fp, const struct iovec *iov, int iovcnt);
+int oufs_freadv(OUFILE *fp, const struct iovec *iov, int iovcnt);
+int oufs_fread_blocks(OUFILE *fp, int len, OUFS_BLOCK_CALLBACK callback, void *arg);
+int oufs_fseek(OUFILE *fp, int offset, int whence);
+int oufs_ftell(OUFILE *fp);
+int oufs_pread(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_pwrite(OUFILE *fp, unsigned char *buf, int len, int offset);
+int oufs_punch_hole(OUFILE *fp, int offset, int len);
 int oufs_remove(char *cwd, char *path);
 int oufs_link(char *cwd, char *path_src, char *path_dst);
 int oufs_touch(char *cwd, char *path);
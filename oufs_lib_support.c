@@ -1,10 +1,381 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <libgen.h>
 #include <string.h>
 #include "oufs_lib.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define debug 0
 
+// Most blocks moved by one multi-block read or write of file data
+#define OUFS_IO_BLOCKS 32
+
+// Blocks kept in memory for the whole session: the master block followed
+//  by the inode table (and the bitmap blocks, if the disk has them), back
+//  to back (see oufs_nth_block()).  They are read on first use and only
+//  written back by oufs_sync() (which also runs when the disk is closed)
+static unsigned char *resident_blocks = NULL;
+static char *resident_dirty = NULL;
+static int n_resident_blocks = 0;
+static int resident_loaded = 0;
+
+// Layout of the disk, worked out from its superblock when the resident
+//  blocks are loaded
+static OUFS_GEOMETRY geometry;
+
+// Next-fit cursors: where the next search for a free block / inode starts
+static int block_cursor = 0;
+static int inode_cursor = 0;
+
+static int oufs_close_hook();
+
+/**
+ * Find a block in a run of blocks of the open disk held back to back, as
+ * vdisk_read_blocks() leaves them
+ * @param blocks first block of the run
+ * @param i which block of the run
+ * @return block i
+ */
+static inline BLOCK *oufs_nth_block(void *blocks, int i)
+{
+  return (BLOCK *) ((unsigned char *) blocks + ((size_t) i << geometry.block_shift));
+}
+
+/**
+ * Work out the layout of a disk from its superblock
+ * @param superblock the disk's superblock
+ * @param format the disk's OUFS_FORMAT_*
+ * @param layout filled in, apart from the bitmap pointers
+ * @return number of blocks at the start of the disk that hold the master
+ *   block, the inodes and the bitmaps
+ */
+static int oufs_layout(VDISK_SUPERBLOCK *superblock, int format, OUFS_GEOMETRY *layout)
+{
+  int block_size = superblock->block_size;
+  layout->block_size = block_size;
+  layout->block_shift = __builtin_ctz(block_size);
+  layout->wide = (format == OUFS_FORMAT_WIDE);
+  layout->inodes_per_block = layout->wide ? (int) WIDE_INODES_PER_BLOCK(block_size)
+                                          : (int) INODES_PER_BLOCK(block_size);
+  layout->entries_per_block = DIRECTORY_ENTRIES_PER_BLOCK(block_size);
+  layout->refs_per_block = layout->wide ? (int) WIDE_REFERENCES_PER_BLOCK(block_size)
+                                        : (int) REFERENCES_PER_BLOCK(block_size);
+  layout->index_records = DIR_INDEX_RECORDS(block_size);
+  layout->name_size = layout->wide ? (int) WIDE_FILE_NAME_SIZE : (int) FILE_NAME_SIZE;
+  layout->inline_size = layout->wide ? (int) WIDE_INLINE_DATA_SIZE : (int) INLINE_DATA_SIZE;
+  layout->n_blocks = superblock->n_blocks;
+  layout->n_inode_blocks = superblock->n_inode_blocks ? (int) superblock->n_inode_blocks : N_INODE_BLOCKS;
+  layout->n_inodes = MIN(layout->n_inode_blocks * (long long) layout->inodes_per_block,
+                         layout->wide ? INT_MAX : OUFS_NARROW_MAX_BLOCKS);
+
+  // Bitmaps that fit in the master block stay there
+  int inode_bytes = (layout->n_inodes + 7) / 8;
+  int block_bytes = (layout->n_blocks + 7) / 8;
+  if (inode_bytes <= (int) MASTER_INODE_FLAG_BYTES(block_size)
+      && block_bytes <= (int) MASTER_BLOCK_FLAG_BYTES)
+    layout->n_bitmap_blocks = 0;
+  else
+    layout->n_bitmap_blocks = (inode_bytes + block_bytes + block_size - 1) / block_size;
+
+  return 1 + layout->n_inode_blocks + layout->n_bitmap_blocks;
+}
+
+/**
+ * Read the master block and the inode table into memory, if that has not
+ * happened yet in this session.  They are adjacent on disk, so this is a
+ * single multi-block read (after a look at the master block, whose format
+ * decides how large the inode table is).
+ *
+ * @return 0 if success, -1 if error
+ */
+static int oufs_load_resident()
+{
+  if (resident_loaded)
+    return 0;
+
+  VDISK_SUPERBLOCK superblock;
+  BLOCK master;
+  vdisk_get_superblock(&superblock);
+  if (vdisk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return -1;
+  int n_resident = oufs_layout(&superblock,
+                               master.master.flags[MASTER_FORMAT_OFFSET(superblock.block_size)],
+                               &geometry);
+  if (n_resident >= geometry.n_blocks
+      || (!geometry.wide && geometry.n_blocks > OUFS_NARROW_MAX_BLOCKS))
+    return -1;
+
+  BLOCK_REFERENCE *refs = malloc(n_resident * sizeof(BLOCK_REFERENCE));
+  free(resident_blocks);
+  free(resident_dirty);
+  resident_blocks = malloc((size_t) n_resident << geometry.block_shift);
+  resident_dirty = calloc(n_resident, 1);
+  n_resident_blocks = n_resident;
+  for (int i = 0; i < n_resident; i++)
+    refs[i] = MASTER_BLOCK_REFERENCE + i;
+  int ret = vdisk_read_blocks(refs, n_resident, resident_blocks);
+  free(refs);
+  if (ret != 0)
+    return -1;
+  resident_loaded = 1;
+
+  // The bitmaps: in the master block, or in the blocks after the inodes
+  if (geometry.n_bitmap_blocks == 0)
+  {
+    geometry.inode_bitmap = oufs_nth_block(resident_blocks, MASTER_BLOCK_REFERENCE)->master.flags;
+    geometry.block_bitmap = geometry.inode_bitmap + MASTER_INODE_FLAG_BYTES(geometry.block_size);
+  }
+  else
+  {
+    geometry.inode_bitmap = oufs_nth_block(resident_blocks, 1 + geometry.n_inode_blocks)->data.data;
+    geometry.block_bitmap = geometry.inode_bitmap + (geometry.n_inodes + 7) / 8;
+  }
+
+  // Make sure our changes are written back before the disk goes away
+  vdisk_set_close_hook(oufs_close_hook);
+  return 0;
+}
+
+/**
+ * Note that bits of an allocation bitmap changed, so that the block(s)
+ * holding them are written back on sync
+ * @param bitmap geometry.inode_bitmap or geometry.block_bitmap
+ * @param first first bit changed
+ * @param len number of bits changed
+ */
+static void oufs_bitmap_dirty(unsigned char *bitmap, int first, int len)
+{
+  long first_byte = (bitmap + first / 8) - resident_blocks;
+  long last_byte = (bitmap + (first + len - 1) / 8) - resident_blocks;
+  for (long b = first_byte >> geometry.block_shift; b <= last_byte >> geometry.block_shift; b++)
+    resident_dirty[b] = 1;
+}
+
+/**
+ * Describe the layout of the open disk
+ * @param layout filled in with the geometry and the in-memory bitmaps
+ * @return 0 if success, -1 if error
+ */
+int oufs_get_geometry(OUFS_GEOMETRY *layout)
+{
+  if (oufs_load_resident() != 0)
+    return -1;
+  *layout = geometry;
+  return 0;
+}
+
+/**********************************************************************/
+// Reference width
+//
+// References are 32 bits in memory.  A disk formatted with
+//  OUFS_FORMAT_WIDE stores them that way; any other disk stores them in 16
+//  bits.  Only the helpers below (and the inode table accessors) look at
+//  how references are stored.
+
+/**
+ * @param ref a reference as stored on a disk with 16-bit references
+ * @return the reference, with the markers mapped to their 32-bit values
+ */
+static inline BLOCK_REFERENCE oufs_widen(NARROW_REFERENCE ref)
+{
+  if (ref >= NARROW_UNALLOCATED - 1)
+    return UNALLOCATED_BLOCK - (NARROW_UNALLOCATED - ref);
+  return ref;
+}
+
+/**
+ * @param ref a reference (below OUFS_NARROW_MAX_BLOCKS, or a marker)
+ * @return the reference as stored on a disk with 16-bit references
+ */
+static inline NARROW_REFERENCE oufs_narrow(BLOCK_REFERENCE ref)
+{
+  if (ref >= UNALLOCATED_BLOCK - 1)
+    return NARROW_UNALLOCATED - (UNALLOCATED_BLOCK - ref);
+  return ref;
+}
+
+/**
+ * The accessors taking a wide argument are always inlined, so that a loop
+ * calling them with a constant (after testing geometry.wide once) reads
+ * references at their stored width, with no test inside the loop.
+ * @param block indirect block
+ * @param i slot, below geometry.refs_per_block
+ * @param wide 1 if references are stored in 32 bits (geometry.wide)
+ * @return the block it refers to
+ */
+static inline __attribute__((always_inline))
+BLOCK_REFERENCE oufs_indirect_get_as(BLOCK *block, int i, int wide)
+{
+  if (wide)
+    return block->wide_indirect.block[i];
+  return oufs_widen(block->indirect.block[i]);
+}
+
+/**
+ * @param block indirect block
+ * @param i slot, below geometry.refs_per_block
+ * @return the block it refers to
+ */
+static inline BLOCK_REFERENCE oufs_indirect_get(BLOCK *block, int i)
+{
+  return oufs_indirect_get_as(block, i, geometry.wide);
+}
+
+/**
+ * @param block indirect block
+ * @param i slot, below geometry.refs_per_block
+ * @param ref block it is to refer to
+ */
+static inline void oufs_indirect_set(BLOCK *block, int i, BLOCK_REFERENCE ref)
+{
+  if (geometry.wide)
+    block->wide_indirect.block[i] = ref;
+  else
+    block->indirect.block[i] = oufs_narrow(ref);
+}
+
+/**
+ * @return the size of a name field in a directory entry of the open disk
+ *   (names are at most one character shorter)
+ */
+static inline int oufs_name_size()
+{
+  return geometry.name_size;
+}
+
+/**
+ * @param block directory block
+ * @param i slot, below geometry.entries_per_block
+ * @param wide 1 if references are stored in 32 bits (geometry.wide)
+ * @return inode the entry refers to (UNALLOCATED_INODE if it is unused)
+ */
+static inline __attribute__((always_inline))
+INODE_REFERENCE oufs_entry_inode_as(BLOCK *block, int i, int wide)
+{
+  if (wide)
+    return block->wide_directory.entry[i].inode_reference;
+  return oufs_widen(block->directory.entry[i].inode_reference);
+}
+
+/**
+ * @param block directory block
+ * @param i slot, below geometry.entries_per_block
+ * @return inode the entry refers to (UNALLOCATED_INODE if it is unused)
+ */
+INODE_REFERENCE oufs_entry_inode(BLOCK *block, int i)
+{
+  return oufs_entry_inode_as(block, i, geometry.wide);
+}
+
+/**
+ * @param block directory block
+ * @return the first unused slot, or -1 if the block is full
+ */
+static int oufs_free_entry(BLOCK *block)
+{
+  int n_entries = geometry.entries_per_block;
+  if (geometry.wide)
+  {
+    for (int i = 0; i < n_entries; i++)
+      if (oufs_entry_inode_as(block, i, 1) == UNALLOCATED_INODE)
+        return i;
+  }
+  else
+  {
+    for (int i = 0; i < n_entries; i++)
+      if (oufs_entry_inode_as(block, i, 0) == UNALLOCATED_INODE)
+        return i;
+  }
+  return -1;
+}
+
+/**
+ * Fill in a directory entry.  The name field is at the start of the entry
+ * in both layouts, so entry[i].name reads it either way.
+ * @param block directory block
+ * @param i slot, below geometry.entries_per_block
+ * @param name name, truncated to fit ("" for an unused entry)
+ * @param ref inode it refers to (UNALLOCATED_INODE for an unused entry)
+ */
+static void oufs_entry_set(BLOCK *block, int i, const char *name, INODE_REFERENCE ref)
+{
+  char *field = block->directory.entry[i].name;
+  int size = oufs_name_size();
+
+  memset(field, '\0', size);
+  strncpy(field, name, size - 1);
+  if (geometry.wide)
+    block->wide_directory.entry[i].inode_reference = ref;
+  else
+    block->directory.entry[i].inode_reference = oufs_narrow(ref);
+}
+
+/**
+ * Get the in-memory master block, reading it from disk on first use.
+ * Callers that change it must set resident_dirty[MASTER_BLOCK_REFERENCE].
+ *
+ * @return pointer to the master block; NULL if it cannot be read
+ */
+static MASTER_BLOCK *oufs_get_master()
+{
+  if (oufs_load_resident() != 0)
+    return NULL;
+  return &oufs_nth_block(resident_blocks, MASTER_BLOCK_REFERENCE)->master;
+}
+
+/**
+ * Write back the file system state held in memory: the master block and
+ * the inode blocks that changed, in one multi-block write
+ *
+ * @return 0 if success, -1 if error
+ */
+int oufs_sync()
+{
+  if (!resident_loaded)
+    return 0;
+
+  // Each run of dirty blocks goes out straight from the resident copy
+  BLOCK_REFERENCE refs[OUFS_IO_BLOCKS];
+  for (int i = 0; i < n_resident_blocks; )
+  {
+    int n_run = 0;
+    while (i + n_run < n_resident_blocks && n_run < OUFS_IO_BLOCKS && resident_dirty[i + n_run])
+    {
+      refs[n_run] = MASTER_BLOCK_REFERENCE + i + n_run;
+      n_run++;
+    }
+    if (n_run == 0)
+    {
+      i++;
+      continue;
+    }
+    if (vdisk_write_blocks(refs, n_run, oufs_nth_block(resident_blocks, i)) != 0)
+      return -1;
+    memset(&resident_dirty[i], 0, n_run);
+    i += n_run;
+  }
+  return 0;
+}
+
+/**
+ * Called when the virtual disk is closed: write everything back and forget
+ * it, since the next disk opened may be a different one
+ *
+ * @return 0 if success, -1 if error
+ */
+static int oufs_close_hook()
+{
+  int ret = oufs_sync();
+  resident_loaded = 0;
+  oufs_dentry_reset();
+  block_cursor = 0;
+  inode_cursor = 0;
+  return ret;
+}
+
 /**
  * Read the ZPWD and ZDISK environment variables & copy their values into cwd and disk_name.
  * If these environment variables are not set, then reasonable defaults are given.
@@ -39,12 +410,12 @@ void oufs_get_environment(char *cwd, char *disk_name)
 /**
  * Configure a directory entry so that it has no name and no inode
  *
- * @param entry The directory entry to be cleaned
+ * @param block The directory block holding the entry
+ * @param i The slot of the entry to be cleaned
  */
-void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry) 
+void oufs_clean_directory_entry(BLOCK *block, int i)
 {
-  entry->name[0] = 0;  // No name
-  entry->inode_reference = UNALLOCATED_INODE;
+  oufs_entry_set(block, i, "", UNALLOCATED_INODE);
 }
 
 /**
@@ -62,29 +433,186 @@ void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BL
   if(debug)
     fprintf(stderr, "New clean directory: self=%d, parent=%d\n", self, parent);
 
-  // Create an empty directory entry
-  DIRECTORY_ENTRY entry;
-  oufs_clean_directory_entry(&entry);
-
-  // Copy empty directory entries across the entire directory list
-  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-    block->directory.entry[i] = entry;
+  // Empty directory entries across the entire directory list
+  for(int i = 0; i < geometry.entries_per_block; ++i) {
+    oufs_clean_directory_entry(block, i);
   }
 
   // Now we will set up the two fixed directory entries
 
   // Self
-  strncpy(entry.name, ".", 2);
-  entry.inode_reference = self;
-  block->directory.entry[0] = entry;
+  oufs_entry_set(block, 0, ".", self);
 
   // Parent (same as self
-  strncpy(entry.name, "..", 3);
-  entry.inode_reference = parent;
-  block->directory.entry[1] = entry;
+  oufs_entry_set(block, 1, "..", parent);
   
 }
 
+/**********************************************************************/
+// Allocation bitmaps
+//
+// Bit i of a bitmap is bit (i % 8) of byte (i / 8); 1 = allocated.  The
+//  bitmaps are scanned 64 bits at a time.
+
+/**
+ * Fetch 64 bits of a bitmap, starting at bit 64 * word.  Bits past the end
+ * of the bitmap read as allocated.
+ */
+static uint64_t oufs_bitmap_word(unsigned char *bitmap, int n_bits, int word)
+{
+  int first_byte = word * 8;
+  int n_bytes = MIN(8, (n_bits + 7) / 8 - first_byte);
+  uint64_t value = 0;
+
+  memcpy(&value, bitmap + first_byte, n_bytes);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+
+  // Pad the tail with allocated bits
+  int valid = n_bits - word * 64;
+  if (valid < 64)
+    value |= ~(uint64_t)0 << valid;
+  return value;
+}
+
+/**
+ * Find the first bit in [from, to) that is clear (or set, if find_set)
+ *
+ * @return the bit index, or -1 if there is none
+ */
+static int oufs_bitmap_scan(unsigned char *bitmap, int n_bits, int from, int to, int find_set)
+{
+  if (from >= to)
+    return -1;
+
+  int last_word = (to - 1) >> 6;
+  for (int w = from >> 6; w <= last_word; w++)
+  {
+    uint64_t candidates = oufs_bitmap_word(bitmap, n_bits, w);
+    if (!find_set)
+      candidates = ~candidates;
+
+    // Ignore bits outside of [from, to)
+    if (w == (from >> 6))
+      candidates &= ~(uint64_t)0 << (from & 63);
+    if (w == last_word && (to & 63) != 0)
+      candidates &= ~(~(uint64_t)0 << (to & 63));
+
+    if (candidates != 0)
+      return (w << 6) + __builtin_ctzll(candidates);
+  }
+  return -1;
+}
+
+/**
+ * Find a clear bit, looking first at start and after it, then wrapping
+ * around to the beginning of the bitmap (next fit)
+ *
+ * @param bitmap the bitmap
+ * @param n_bits number of bits in the bitmap
+ * @param start where to start looking
+ * @return index of the clear bit, or -1 if all bits are set
+ */
+int oufs_bitmap_find_free(unsigned char *bitmap, int n_bits, int start)
+{
+  int bit = oufs_bitmap_scan(bitmap, n_bits, start, n_bits, 0);
+  if (bit < 0)
+    bit = oufs_bitmap_scan(bitmap, n_bits, 0, start, 0);
+  return bit;
+}
+
+/**
+ * Find the first run of len clear bits that starts in [from, n_bits)
+ *
+ * @return index of the first bit of the run, or -1 if there is none
+ */
+static int oufs_bitmap_scan_run(unsigned char *bitmap, int n_bits, int len, int from)
+{
+  while (from < n_bits)
+  {
+    // Start of the next free stretch, and its end
+    int first = oufs_bitmap_scan(bitmap, n_bits, from, n_bits, 0);
+    if (first < 0 || first + len > n_bits)
+      return -1;
+    int end = oufs_bitmap_scan(bitmap, n_bits, first, first + len, 1);
+    if (end < 0)
+      return first;
+
+    // Too short: continue after the set bit that cut it off
+    from = end + 1;
+  }
+  return -1;
+}
+
+/**
+ * Find a run of len consecutive clear bits, looking first at runs that start
+ * at or after start, then wrapping around (next fit)
+ *
+ * @param bitmap the bitmap
+ * @param n_bits number of bits in the bitmap
+ * @param len length of the run
+ * @param start where to start looking
+ * @return index of the first bit of the run, or -1 if there is none
+ */
+int oufs_bitmap_find_run(unsigned char *bitmap, int n_bits, int len, int start)
+{
+  int bit = oufs_bitmap_scan_run(bitmap, n_bits, len, start);
+  if (bit < 0 && start > 0)
+    bit = oufs_bitmap_scan_run(bitmap, n_bits, len, 0);
+  return bit;
+}
+
+/**
+ * Find the longest run of clear bits
+ *
+ * @param bitmap the bitmap
+ * @param n_bits number of bits in the bitmap
+ * @param first set to the index of the first bit of the run
+ * @return length of the run (0 if all bits are set)
+ */
+int oufs_bitmap_longest_run(unsigned char *bitmap, int n_bits, int *first)
+{
+  int best = 0;
+  int from = 0;
+
+  while (from < n_bits)
+  {
+    int start = oufs_bitmap_scan(bitmap, n_bits, from, n_bits, 0);
+    if (start < 0)
+      break;
+    int end = oufs_bitmap_scan(bitmap, n_bits, start, n_bits, 1);
+    if (end < 0)
+      end = n_bits;
+
+    if (end - start > best)
+    {
+      best = end - start;
+      *first = start;
+    }
+    from = end;
+  }
+  return best;
+}
+
+/**
+ * Set (allocate) len bits starting at first
+ */
+void oufs_bitmap_set(unsigned char *bitmap, int first, int len)
+{
+  for (int i = first; i < first + len; i++)
+    bitmap[i >> 3] |= (1 << (i & 7));
+}
+
+/**
+ * Clear (free) len bits starting at first
+ */
+void oufs_bitmap_clear(unsigned char *bitmap, int first, int len)
+{
+  for (int i = first; i < first + len; i++)
+    bitmap[i >> 3] &= ~(1 << (i & 7));
+}
+
 /**
  * Allocate a new data block
  *
@@ -96,47 +624,25 @@ void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BL
  */
 BLOCK_REFERENCE oufs_allocate_new_block()
 {
-  BLOCK block;
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Scan for an available block
-  int block_byte;
-  int flag;
-
-  // Loop over each byte in the allocation table.
-  for(block_byte = 0, flag = 1; flag && block_byte < (N_BLOCKS_IN_DISK / 8); ++block_byte) {
-    if(block.master.block_allocated_flag[block_byte] != 0xff) {
-      // Found a byte that has an opening: stop scanning
-      flag = 0;
-      break;
-    };
-  };
-  // Did we find a candidate byte in the table?
-  if(flag == 1) {
-    // No
+  // Get the master block
+  MASTER_BLOCK *master = oufs_get_master();
+  if (master == NULL)
+    return(UNALLOCATED_BLOCK);
+
+  // Scan for an available block, starting where the last search ended
+  int block_reference = oufs_bitmap_find_free(geometry.block_bitmap, geometry.n_blocks, block_cursor);
+  if(block_reference < 0) {
     if(debug)
       fprintf(stderr, "No blocks\n");
     return(UNALLOCATED_BLOCK);
   }
 
-  // Found an available data block 
-
-  // Set the block allocated bit
-  // Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-  int block_bit = oufs_find_open_bit(block.master.block_allocated_flag[block_byte]);
-
   // Now set the bit in the allocation table
-  block.master.block_allocated_flag[block_byte] |= (1 << block_bit);
-
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
-
-  if(debug)
-    fprintf(stderr, "Allocating block=%d (%d)\n", block_byte, block_bit);
+  oufs_bitmap_set(geometry.block_bitmap, block_reference, 1);
+  block_cursor = (block_reference + 1) % geometry.n_blocks;
 
-  // Compute the block index
-  BLOCK_REFERENCE block_reference = (block_byte << 3) + block_bit;
+  // The bitmap is written back on sync
+  oufs_bitmap_dirty(geometry.block_bitmap, block_reference, 1);
 
   if(debug)
     fprintf(stderr, "Allocating block=%d\n", block_reference);
@@ -146,57 +652,86 @@ BLOCK_REFERENCE oufs_allocate_new_block()
 }
 
 /**
- * Allocate a new inode block
+ * Allocate several data blocks, as contiguously as possible
  *
- * If one is found, then the corresponding bit in the block allocation table is set
+ * A single run of n_blocks free blocks is used if there is one, preferably
+ * starting at goal.  Otherwise the largest free runs are taken one after
+ * the other until enough blocks are allocated.
  *
- * @return The index of the allocated data block.  If no blocks are available,
- * then UNALLOCATED_BLOCK is returned
+ * @param n_blocks number of blocks wanted
+ * @param goal preferred first block (e.g. the block following the end of
+ *   a file); UNALLOCATED_BLOCK for no preference
+ * @param refs filled in with the allocated blocks, in order
+ * @return number of blocks allocated; less than n_blocks if the disk is full
+ */
+int oufs_allocate_block_run(int n_blocks, BLOCK_REFERENCE goal, BLOCK_REFERENCE *refs)
+{
+  // Get the master block
+  MASTER_BLOCK *master = oufs_get_master();
+  if (master == NULL)
+    return 0;
+
+  int start = (goal < geometry.n_blocks) ? goal : block_cursor;
+  int n_allocated = 0;
+
+  while (n_allocated < n_blocks)
+  {
+    int want = n_blocks - n_allocated;
+    int first = oufs_bitmap_find_run(geometry.block_bitmap, geometry.n_blocks, want, start);
+    if (first < 0)
+    {
+      // No run is long enough: take the longest one there is
+      int longest = oufs_bitmap_longest_run(geometry.block_bitmap, geometry.n_blocks, &first);
+      if (longest == 0)
+        break;
+      want = longest;
+    }
+
+    oufs_bitmap_set(geometry.block_bitmap, first, want);
+    oufs_bitmap_dirty(geometry.block_bitmap, first, want);
+    for (int i = 0; i < want; i++)
+      refs[n_allocated++] = first + i;
+    start = (first + want) % geometry.n_blocks;
+
+    if (debug)
+      fprintf(stderr, "Allocating blocks=%d..%d\n", first, first + want - 1);
+  }
+
+  if (n_allocated > 0)
+    block_cursor = start;
+  return n_allocated;
+}
+
+/**
+ * Allocate a new inode
+ *
+ * If one is found, then the corresponding bit in the inode allocation table is set
+ *
+ * @return The index of the allocated inode.  If no inodes are available,
+ * then UNALLOCATED_INODE is returned
  *
  */
-BLOCK_REFERENCE oufs_allocate_new_inode()
+INODE_REFERENCE oufs_allocate_new_inode()
 {
-  BLOCK block;
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Scan for an available block
-  int inode_byte;
-  int flag;
-
-  // Loop over each byte in the allocation table.
-  for(inode_byte = 0, flag = 1; flag && inode_byte < (N_BLOCKS_IN_DISK / 8); ++inode_byte) {
-    if(block.master.inode_allocated_flag[inode_byte] != 0xff) {
-      // Found a byte that has an opening: stop scanning
-      flag = 0;
-      break;
-    };
-  };
-  // Did we find a candidate byte in the table?
-  if(flag == 1) {
-    // No
+  // Get the master block
+  MASTER_BLOCK *master = oufs_get_master();
+  if (master == NULL)
+    return(UNALLOCATED_INODE);
+
+  // Scan for an available inode, starting where the last search ended
+  int inode_reference = oufs_bitmap_find_free(geometry.inode_bitmap, geometry.n_inodes, inode_cursor);
+  if(inode_reference < 0) {
     if(debug)
       fprintf(stderr, "No inode\n");
     return(UNALLOCATED_INODE);
   }
 
-  // Found an available data block 
-
-  // Set the block allocated bit
-  // Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-  int inode_bit = oufs_find_open_bit(block.master.inode_allocated_flag[inode_byte]);
-
   // Now set the bit in the allocation table
-  block.master.inode_allocated_flag[inode_byte] |= (1 << inode_bit);
-
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
-
-  if(debug)
-    fprintf(stderr, "Allocating inode=%d (%d)\n", inode_byte, inode_bit);
+  oufs_bitmap_set(geometry.inode_bitmap, inode_reference, 1);
+  inode_cursor = (inode_reference + 1) % geometry.n_inodes;
 
-  // Compute the block index
-  INODE_REFERENCE inode_reference = (inode_byte << 3) + inode_bit;
+  // The bitmap is written back on sync
+  oufs_bitmap_dirty(geometry.inode_bitmap, inode_reference, 1);
 
   if(debug)
     fprintf(stderr, "Allocating inode=%d\n", inode_reference);
@@ -212,24 +747,21 @@ BLOCK_REFERENCE oufs_allocate_new_inode()
  */
 int oufs_deallocate_block(BLOCK_REFERENCE block_ref)
 {
-  // Read the master block
-  BLOCK block;
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Calculate the byte and bit to change
-  int block_bit = block_ref & 0b111;
-  int block_byte = block_ref >> 3;
+  // Get the master block
+  MASTER_BLOCK *master = oufs_get_master();
+  if (master == NULL)
+    return -1;
 
   // Flip the desired bit to 0
-  block.master.block_allocated_flag[block_byte] &= ~(1 << block_bit);
+  if (block_ref >= geometry.n_blocks)
+    return -1;
+  oufs_bitmap_clear(geometry.block_bitmap, block_ref, 1);
 
-  if(debug)
-    fprintf(stderr, "Deallocating block=%d (%d)\n", block_byte, block_bit);
   if(debug)
     fprintf(stderr, "Deallocating block=%d\n", block_ref);
 
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+  // The bitmap is written back on sync
+  oufs_bitmap_dirty(geometry.block_bitmap, block_ref, 1);
 
   return 0;
 }
@@ -241,32 +773,481 @@ int oufs_deallocate_block(BLOCK_REFERENCE block_ref)
  */
 int oufs_deallocate_inode(INODE_REFERENCE inode_ref)
 {
-  // Read the master block
-  BLOCK block;
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Calculate the byte and bit to change
-  int inode_bit = inode_ref & 0b111;
-  int inode_byte = inode_ref >> 3;
+  // Get the master block
+  MASTER_BLOCK *master = oufs_get_master();
+  if (master == NULL)
+    return -1;
 
   // Flip the desired bit to 0
-  block.master.inode_allocated_flag[inode_byte] &= ~(1 << inode_bit);
+  if (inode_ref >= geometry.n_inodes)
+    return -1;
+  oufs_bitmap_clear(geometry.inode_bitmap, inode_ref, 1);
 
-  if(debug)
-    fprintf(stderr, "Deallocating inode=%d (%d)\n", inode_byte, inode_bit);
   if(debug)
     fprintf(stderr, "Deallocating inode=%d\n", inode_ref);
 
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+  // The bitmap is written back on sync
+  oufs_bitmap_dirty(geometry.inode_bitmap, inode_ref, 1);
 
   return 0;
 }
 
 /**
- *  Given an inode reference, read the inode from the virtual disk.
- *
- *  @param i Inode reference (index into the inode list)
+ * @return the inode format of the disk (OUFS_FORMAT_*)
+ */
+static int oufs_inode_format()
+{
+  MASTER_BLOCK *master = oufs_get_master();
+  if (master == NULL)
+    return OUFS_FORMAT_DIRECT;
+  return master->flags[MASTER_FORMAT_OFFSET(geometry.block_size)];
+}
+
+/**
+ * @return the largest file the disk's inode format can describe, in bytes
+ */
+int oufs_max_file_size()
+{
+  if (oufs_inode_format() == OUFS_FORMAT_DIRECT)
+    return BLOCKS_PER_INODE * geometry.block_size;
+
+  // Sizes are ints: with large blocks the tree can describe more than that
+  long long size = (N_DIRECT_BLOCKS + geometry.refs_per_block
+                    + (long long) geometry.refs_per_block * geometry.refs_per_block)
+                   * geometry.block_size;
+  return (size > INT_MAX) ? INT_MAX : (int) size;
+}
+
+/**
+ * @param inode inode of a file
+ * @return the file's contents if they are kept in the inode, NULL otherwise
+ */
+static unsigned char *oufs_inline_data(INODE *inode)
+{
+  if (inode->type != IT_FILE || inode->data[0] != INLINE_DATA_MARKER)
+    return NULL;
+  return (unsigned char *) &inode->data[1];
+}
+
+/**
+ * Empty a map cache
+ * @param map cache to set up
+ */
+void oufs_map_init(OUFS_MAP_CACHE *map)
+{
+  for (int slot = 0; slot < 2; slot++)
+  {
+    map->ref[slot] = UNALLOCATED_BLOCK;
+    map->dirty[slot] = 0;
+  }
+}
+
+/**
+ * Write back the indirect blocks a map cache has changed
+ * @param map cache to flush
+ * @return 0 if success, -1 if error
+ */
+static int oufs_map_flush(OUFS_MAP_CACHE *map)
+{
+  for (int slot = 0; slot < 2; slot++)
+  {
+    if (map->dirty[slot])
+    {
+      if (vdisk_write_block(map->ref[slot], &map->block[slot]) != 0)
+        return -1;
+      map->dirty[slot] = 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Bring an indirect block into a map cache slot, writing back what the
+ * slot held if it changed
+ * @param map cache
+ * @param slot 0 or 1
+ * @param ref indirect block wanted
+ * @return 0 if success, -1 if error
+ */
+static int oufs_map_load(OUFS_MAP_CACHE *map, int slot, BLOCK_REFERENCE ref)
+{
+  if (map->ref[slot] == ref)
+    return 0;
+
+  if (map->dirty[slot] && vdisk_write_block(map->ref[slot], &map->block[slot]) != 0)
+    return -1;
+  map->dirty[slot] = 0;
+
+  if (vdisk_read_block(ref, &map->block[slot]) != 0)
+  {
+    map->ref[slot] = UNALLOCATED_BLOCK;
+    return -1;
+  }
+  map->ref[slot] = ref;
+  return 0;
+}
+
+/**
+ * Find the disk block holding a block of a file.  This takes at most two
+ * indirect blocks, which are kept in the map cache for the next call.
+ * @param inode inode of the file
+ * @param index block index in the file
+ * @param map indirect block cache (NULL to use a temporary one)
+ * @return the block, or UNALLOCATED_BLOCK if the file has none there
+ */
+BLOCK_REFERENCE oufs_map_block(INODE *inode, int index, OUFS_MAP_CACHE *map)
+{
+  OUFS_MAP_CACHE local_map;
+  if (map == NULL)
+  {
+    oufs_map_init(&local_map);
+    map = &local_map;
+  }
+
+  if (index < 0 || oufs_inline_data(inode) != NULL)
+    return UNALLOCATED_BLOCK;
+  if (oufs_inode_format() == OUFS_FORMAT_DIRECT)
+    return (index < BLOCKS_PER_INODE) ? inode->data[index] : UNALLOCATED_BLOCK;
+  if (index < N_DIRECT_BLOCKS)
+    return inode->data[index];
+
+  // Find the indirect block holding the reference
+  int refs_per_block = geometry.refs_per_block;
+  index -= N_DIRECT_BLOCKS;
+  BLOCK_REFERENCE leaf = inode->data[INDIRECT_INDEX];
+  if (index >= refs_per_block)
+  {
+    index -= refs_per_block;
+    BLOCK_REFERENCE top = inode->data[DOUBLE_INDIRECT_INDEX];
+    if (index >= refs_per_block * refs_per_block || top == UNALLOCATED_BLOCK
+        || oufs_map_load(map, 1, top) != 0)
+      return UNALLOCATED_BLOCK;
+    leaf = oufs_indirect_get(&map->block[1], index / refs_per_block);
+    index %= refs_per_block;
+  }
+
+  if (leaf == UNALLOCATED_BLOCK || oufs_map_load(map, 0, leaf) != 0)
+    return UNALLOCATED_BLOCK;
+  return oufs_indirect_get(&map->block[0], index);
+}
+
+/**
+ * Allocate an indirect block with no references in it
+ * @return the block, or UNALLOCATED_BLOCK if the disk is full
+ */
+static BLOCK_REFERENCE oufs_new_indirect_block()
+{
+  BLOCK block;
+  BLOCK_REFERENCE ref = oufs_allocate_new_block();
+  if (ref == UNALLOCATED_BLOCK)
+    return UNALLOCATED_BLOCK;
+
+  vdisk_fill_block(&block, 0xff, geometry.block_size);
+  vdisk_write_block(ref, &block);
+  return ref;
+}
+
+/**
+ * Make a block of a file refer to a disk block, adding indirect blocks as
+ * needed.  Changed indirect blocks stay in the map cache until
+ * oufs_map_flush().
+ * @param inode inode of the file (updated, not written back)
+ * @param index block index in the file
+ * @param ref disk block
+ * @param map indirect block cache
+ * @return 0 if success, -1 if the index is too large or the disk is full
+ */
+static int oufs_map_set(INODE *inode, int index, BLOCK_REFERENCE ref, OUFS_MAP_CACHE *map)
+{
+  if (oufs_inode_format() == OUFS_FORMAT_DIRECT || index < N_DIRECT_BLOCKS)
+  {
+    if (index >= BLOCKS_PER_INODE)
+      return -1;
+    inode->data[index] = ref;
+    return 0;
+  }
+
+  // Find (or add) the indirect block that will hold the reference
+  int refs_per_block = geometry.refs_per_block;
+  index -= N_DIRECT_BLOCKS;
+  BLOCK_REFERENCE leaf = inode->data[INDIRECT_INDEX];
+  if (index >= refs_per_block)
+  {
+    index -= refs_per_block;
+    if (index >= refs_per_block * refs_per_block)
+      return -1;
+
+    BLOCK_REFERENCE *top = &inode->data[DOUBLE_INDIRECT_INDEX];
+    if (*top == UNALLOCATED_BLOCK && (*top = oufs_new_indirect_block()) == UNALLOCATED_BLOCK)
+      return -1;
+    if (oufs_map_load(map, 1, *top) != 0)
+      return -1;
+    leaf = oufs_indirect_get(&map->block[1], index / refs_per_block);
+    if (leaf == UNALLOCATED_BLOCK)
+    {
+      if ((leaf = oufs_new_indirect_block()) == UNALLOCATED_BLOCK)
+        return -1;
+      oufs_indirect_set(&map->block[1], index / refs_per_block, leaf);
+      map->dirty[1] = 1;
+    }
+    index %= refs_per_block;
+  }
+  else if (leaf == UNALLOCATED_BLOCK)
+  {
+    if ((leaf = oufs_new_indirect_block()) == UNALLOCATED_BLOCK)
+      return -1;
+    inode->data[INDIRECT_INDEX] = leaf;
+  }
+
+  if (oufs_map_load(map, 0, leaf) != 0)
+    return -1;
+  oufs_indirect_set(&map->block[0], index, ref);
+  map->dirty[0] = 1;
+  return 0;
+}
+
+// Blocks of a file being released, zeroed and deallocated in batches
+typedef struct oufs_release_batch_s
+{
+  BLOCK_REFERENCE refs[OUFS_IO_BLOCKS];
+  int n_refs;
+} OUFS_RELEASE_BATCH;
+
+/**
+ * Clear out and deallocate the blocks in a batch with a single multi-block
+ * write
+ * @param batch blocks to release (emptied)
+ */
+static void oufs_release_batch(OUFS_RELEASE_BATCH *batch)
+{
+  BLOCK blank[OUFS_IO_BLOCKS];
+
+  if (batch->n_refs == 0)
+    return;
+
+  // Clear out block data
+  memset(blank, 0, (size_t) batch->n_refs << geometry.block_shift);
+  vdisk_write_blocks(batch->refs, batch->n_refs, blank);
+
+  // Deallocate blocks
+  for (int i = 0; i < batch->n_refs; i++)
+    oufs_deallocate_block(batch->refs[i]);
+  batch->n_refs = 0;
+}
+
+/**
+ * Add a block to a release batch
+ * @param batch batch to add to (released when full)
+ * @param ref block to release
+ */
+static void oufs_release_add(OUFS_RELEASE_BATCH *batch, BLOCK_REFERENCE ref)
+{
+  if (ref == UNALLOCATED_BLOCK)
+    return;
+  batch->refs[batch->n_refs++] = ref;
+  if (batch->n_refs == OUFS_IO_BLOCKS)
+    oufs_release_batch(batch);
+}
+
+/**
+ * Release an indirect block and every block below it
+ * @param batch batch to add the blocks to
+ * @param ref indirect block
+ * @param depth 1 if it refers to data blocks, 2 if to indirect blocks
+ */
+static void oufs_release_tree(OUFS_RELEASE_BATCH *batch, BLOCK_REFERENCE ref, int depth);
+
+/**
+ * Release every block an indirect block refers to (see oufs_release_tree())
+ * @param wide 1 if references are stored in 32 bits (geometry.wide)
+ */
+static inline __attribute__((always_inline))
+void oufs_release_references(OUFS_RELEASE_BATCH *batch, BLOCK *block, int depth, int wide)
+{
+  for (int i = 0; i < geometry.refs_per_block; i++)
+  {
+    if (depth > 1)
+      oufs_release_tree(batch, oufs_indirect_get_as(block, i, wide), depth - 1);
+    else
+      oufs_release_add(batch, oufs_indirect_get_as(block, i, wide));
+  }
+}
+
+static void oufs_release_tree(OUFS_RELEASE_BATCH *batch, BLOCK_REFERENCE ref, int depth)
+{
+  BLOCK block;
+
+  if (ref == UNALLOCATED_BLOCK || vdisk_read_block(ref, &block) != 0)
+    return;
+
+  if (geometry.wide)
+    oufs_release_references(batch, &block, depth, 1);
+  else
+    oufs_release_references(batch, &block, depth, 0);
+  oufs_release_add(batch, ref);
+}
+
+/**
+ * Clear out and deallocate every block of a file, including its indirect
+ * blocks.  The blocks are zeroed with a few multi-block writes.  The inode
+ * is left empty but is not written back.
+ * @param inode inode of the file
+ */
+void oufs_release_file_blocks(INODE *inode)
+{
+  OUFS_RELEASE_BATCH batch;
+  batch.n_refs = 0;
+
+  if (oufs_inline_data(inode) != NULL)
+    ;  // No blocks
+  else if (oufs_inode_format() == OUFS_FORMAT_DIRECT)
+  {
+    for (int i = 0; i < BLOCKS_PER_INODE; i++)
+      oufs_release_add(&batch, inode->data[i]);
+  }
+  else
+  {
+    for (int i = 0; i < N_DIRECT_BLOCKS; i++)
+      oufs_release_add(&batch, inode->data[i]);
+    oufs_release_tree(&batch, inode->data[INDIRECT_INDEX], 1);
+    oufs_release_tree(&batch, inode->data[DOUBLE_INDIRECT_INDEX], 2);
+  }
+  oufs_release_batch(&batch);
+
+  for (int i = 0; i < BLOCKS_PER_INODE; i++)
+    inode->data[i] = UNALLOCATED_BLOCK;
+  inode->size = 0;
+}
+
+/**
+ * Release an indirect block if none of its references are in use
+ * @param map indirect block cache to load it through
+ * @param slot cache slot to use
+ * @param ref where the file refers to the block (set to UNALLOCATED_BLOCK
+ *   if the block is released)
+ * @param batch batch to add the block to
+ * @return 1 if the block was released, 0 if not
+ */
+static int oufs_prune_block(OUFS_MAP_CACHE *map, int slot, BLOCK_REFERENCE *ref,
+                            OUFS_RELEASE_BATCH *batch)
+{
+  if (*ref == UNALLOCATED_BLOCK || oufs_map_load(map, slot, *ref) != 0)
+    return 0;
+
+  int n_refs = geometry.refs_per_block;
+  BLOCK *block = &map->block[slot];
+  if (geometry.wide)
+  {
+    for (int i = 0; i < n_refs; i++)
+      if (oufs_indirect_get_as(block, i, 1) != UNALLOCATED_BLOCK)
+        return 0;
+  }
+  else
+  {
+    for (int i = 0; i < n_refs; i++)
+      if (oufs_indirect_get_as(block, i, 0) != UNALLOCATED_BLOCK)
+        return 0;
+  }
+
+  // Forget it first, so that it is never written back
+  map->ref[slot] = UNALLOCATED_BLOCK;
+  map->dirty[slot] = 0;
+  oufs_release_add(batch, *ref);
+  *ref = UNALLOCATED_BLOCK;
+  return 1;
+}
+
+/**
+ * Release the indirect blocks of a file that no longer refer to anything
+ * once blocks first_index ... last_index are gone
+ * @param inode inode of the file (updated, not written back)
+ * @param map indirect block cache of the file
+ * @param first_index first block index released
+ * @param last_index last block index released
+ * @param batch batch to add the blocks to
+ */
+static void oufs_prune_indirect(INODE *inode, OUFS_MAP_CACHE *map,
+                                int first_index, int last_index, OUFS_RELEASE_BATCH *batch)
+{
+  if (oufs_inode_format() == OUFS_FORMAT_DIRECT)
+    return;
+
+  int first = first_index - N_DIRECT_BLOCKS;
+  int last = last_index - N_DIRECT_BLOCKS;
+  if (last < 0)
+    return;
+
+  // Single-indirect block
+  int refs_per_block = geometry.refs_per_block;
+  if (first < refs_per_block)
+    oufs_prune_block(map, 0, &inode->data[INDIRECT_INDEX], batch);
+
+  // Double-indirect: the second-level blocks covering the range, then the top
+  first -= refs_per_block;
+  last -= refs_per_block;
+  BLOCK_REFERENCE top = inode->data[DOUBLE_INDIRECT_INDEX];
+  if (last < 0 || top == UNALLOCATED_BLOCK || oufs_map_load(map, 1, top) != 0)
+    return;
+  if (first < 0)
+    first = 0;
+  last = MIN(last / refs_per_block, refs_per_block - 1);
+  for (int i = first / refs_per_block; i <= last; i++)
+  {
+    BLOCK_REFERENCE leaf = oufs_indirect_get(&map->block[1], i);
+    if (oufs_prune_block(map, 0, &leaf, batch))
+    {
+      oufs_indirect_set(&map->block[1], i, leaf);
+      map->dirty[1] = 1;
+    }
+  }
+  oufs_prune_block(map, 1, &inode->data[DOUBLE_INDIRECT_INDEX], batch);
+}
+
+/**
+ * Convert an inode stored with 16-bit references.  Inline contents are
+ * copied as they are.
+ * @param stored inode as stored on disk
+ * @param inode filled in
+ */
+static void oufs_widen_inode(const NARROW_INODE *stored, INODE *inode)
+{
+  inode->type = stored->type;
+  inode->n_references = stored->n_references;
+  inode->size = stored->size;
+  if (stored->data[0] == NARROW_UNALLOCATED - 1)
+  {
+    inode->data[0] = INLINE_DATA_MARKER;
+    memcpy(&inode->data[1], &stored->data[1], INLINE_DATA_SIZE);
+    return;
+  }
+  for (int i = 0; i < BLOCKS_PER_INODE; i++)
+    inode->data[i] = oufs_widen(stored->data[i]);
+}
+
+/**
+ * Convert an inode to be stored with 16-bit references
+ * @param inode inode to store
+ * @param stored filled in
+ */
+static void oufs_narrow_inode(const INODE *inode, NARROW_INODE *stored)
+{
+  stored->type = inode->type;
+  stored->n_references = inode->n_references;
+  stored->size = inode->size;
+  if (inode->data[0] == INLINE_DATA_MARKER)
+  {
+    stored->data[0] = NARROW_UNALLOCATED - 1;
+    memcpy(&stored->data[1], &inode->data[1], INLINE_DATA_SIZE);
+    return;
+  }
+  for (int i = 0; i < BLOCKS_PER_INODE; i++)
+    stored->data[i] = oufs_narrow(inode->data[i]);
+}
+
+/**
+ *  Given an inode reference, read the inode from the in-memory inode table.
+ *
+ *  @param i Inode reference (index into the inode list)
  *  @param inode Pointer to an inode memory structure.  This structure will be
  *                filled in before return)
  *  @return 0 = successfully loaded the inode
@@ -278,159 +1259,937 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
   if(debug)
     fprintf(stderr, "Fetching inode %d\n", i);
 
+  if (oufs_load_resident() != 0 || i >= geometry.n_inodes)
+    return(-1);
+
+  // Find the address of the inode block and the inode within the block
+  BLOCK_REFERENCE block = i / geometry.inodes_per_block + 1;
+  int element = (i % geometry.inodes_per_block);
+
+  BLOCK *inodes = oufs_nth_block(resident_blocks, block);
+  if (geometry.wide)
+    *inode = inodes->wide_inodes.inode[element];
+  else
+    oufs_widen_inode(&inodes->inodes.inode[element], inode);
+  return(0);
+}
+
+/**
+ * Type of an inode, read from the inode table without converting the
+ * whole inode (path lookups only need the type of each directory)
+ * @param i inode reference
+ * @return IT_NONE, IT_DIRECTORY or IT_FILE (IT_NONE if i cannot be read)
+ */
+static char oufs_inode_type(INODE_REFERENCE i)
+{
+  if (oufs_load_resident() != 0 || i >= geometry.n_inodes)
+    return IT_NONE;
+
+  BLOCK *inodes = oufs_nth_block(resident_blocks, i / geometry.inodes_per_block + 1);
+  int element = (i % geometry.inodes_per_block);
+  if (geometry.wide)
+    return inodes->wide_inodes.inode[element].type;
+  return inodes->inodes.inode[element].type;
+}
+
+/**
+ *  Given an inode reference, update the inode in the in-memory inode table.
+ *  The inode block is written to the virtual disk by oufs_sync().
+ *
+ *  @param i Inode reference (index into the inode list)
+ *  @param inode Pointer to an inode memory structure.  This structure will be
+ *                written to the disk)
+ *  @return 0 = successfully wrote the inode
+ *         -1 = an error has occurred
+ *
+ */
+int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+{
+  if(debug)
+    fprintf(stderr, "Writing inode %d\n", i);
+
+  if (oufs_load_resident() != 0 || i >= geometry.n_inodes)
+    return(-1);
+
   // Find the address of the inode block and the inode within the block
-  BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-  int element = (i % INODES_PER_BLOCK);
+  BLOCK_REFERENCE block = i / geometry.inodes_per_block + 1;
+  int element = (i % geometry.inodes_per_block);
 
-  BLOCK b;
-  if(vdisk_read_block(block, &b) == 0) {
-    // Successfully loaded the block: copy just this inode
-    *inode = b.inodes.inode[element];
-    return(0);
+  BLOCK *inodes = oufs_nth_block(resident_blocks, block);
+  if (geometry.wide)
+    inodes->wide_inodes.inode[element] = *inode;
+  else
+    oufs_narrow_inode(inode, &inodes->inodes.inode[element]);
+  resident_dirty[block] = 1;
+  return(0);
+}
+
+/**
+ *  Given a byte, find the first open bit. That is, the first 0 from the right
+ *
+ *  @param value the byte to check
+ *  @return index of the first 0, 0 being the rightmost bit
+ *         -1 = an error has occurred
+ */
+int oufs_find_open_bit(unsigned char value)
+{
+  if (value == 0xff)
+    return -1;
+  return __builtin_ctz(~value & 0xff);
+}
+
+/**
+ * Given the cwd and a path, give a path combining them
+ * @param cwd current working directory
+ * @param path working path
+ * @param rel_path the thing we're outputting
+ */
+void oufs_relative_path(char* cwd, char* path, char* rel_path)
+{
+  if (!strcmp(path, ""))
+    // Path is blank so just use the cwd
+    strcat(rel_path, cwd);
+  else 
+  {
+    // Path is supplied so use that
+    // check if supplied path is relative 
+    if (path[0] == '/')
+    {
+      // path is absolute, no further work need by done
+      strcat(rel_path, path);
+    }
+    else
+    {
+      // Path is relative. Concat cwd and path into list_dir
+      memset(rel_path, 0, MAX_PATH_LENGTH);
+      strcat(rel_path, cwd);
+      strcat(rel_path, "/");
+      strcat(rel_path, path);
+    }
+  }
+}
+
+/**
+ *  Format the disk given a virtual disk name
+ * 
+ *  @param virtual_disk_name name of the virtual disk
+ *  @return success code
+ */
+int oufs_format_disk(char  *virtual_disk_name)
+{
+  return oufs_format_disk_geometry(virtual_disk_name, N_BLOCKS_IN_DISK, N_INODES(BLOCK_SIZE),
+                                   BLOCK_SIZE, 0);
+}
+
+/**
+ *  Format the disk given a virtual disk name, with a chosen size.  The
+ *  geometry is recorded in the disk's superblock.
+ *
+ *  @param virtual_disk_name name of the virtual disk
+ *  @param n_blocks number of blocks on the disk
+ *  @param n_inodes number of inodes wanted (rounded up to whole inode blocks)
+ *  @param block_size bytes per block (a power of two from
+ *    VDISK_MIN_BLOCK_SIZE to VDISK_MAX_BLOCK_SIZE)
+ *  @param wide 1 for 32-bit references on disk (OUFS_FORMAT_WIDE), which
+ *    allows more than OUFS_NARROW_MAX_BLOCKS blocks but shortens names
+ *  @return success code
+ */
+int oufs_format_disk_geometry(char *virtual_disk_name, int n_blocks, int n_inodes,
+                              int block_size, int wide)
+{
+  // Check the geometry before touching the disk
+  VDISK_SUPERBLOCK superblock;
+  OUFS_GEOMETRY layout;
+  int format = wide ? OUFS_FORMAT_WIDE : OUFS_FORMAT_DIRINDEX;
+  int max_blocks = wide ? VDISK_MAX_BLOCKS : OUFS_NARROW_MAX_BLOCKS;
+  if (!VDISK_BLOCK_SIZE_OK(block_size))
+  {
+    fprintf(stderr, "format: block size must be a power of two from %d to %d\n",
+            VDISK_MIN_BLOCK_SIZE, VDISK_MAX_BLOCK_SIZE);
+    return -1;
+  }
+  int inodes_per_block = wide ? (int) WIDE_INODES_PER_BLOCK(block_size)
+                              : (int) INODES_PER_BLOCK(block_size);
+  if (n_blocks > max_blocks || n_inodes > max_blocks)
+  {
+    fprintf(stderr, "format: at most %d blocks and %d inodes%s\n", max_blocks, max_blocks,
+            wide ? "" : " (more with 32-bit references)");
+    return -1;
+  }
+  superblock.block_size = block_size;
+  superblock.n_blocks = n_blocks;
+  superblock.n_inode_blocks = (n_inodes + (long long) inodes_per_block - 1) / inodes_per_block;
+  if (n_inodes < 1 || oufs_layout(&superblock, format, &layout) >= n_blocks)
+  {
+    fprintf(stderr, "format: %d blocks cannot hold %d inodes\n", n_blocks, n_inodes);
+    return -1;
+  }
+
+  // Open a new, empty virtual disk
+  if (vdisk_set_geometry(n_blocks, superblock.n_inode_blocks, block_size) != 0
+      || vdisk_disk_open(virtual_disk_name) != 0)
+    return -1;
+
+  // Files get indirect blocks, or keep small contents in the inode, and
+  //  directories can grow past one block.  The format is recorded first,
+  //  since it decides the layout of everything else.
+  BLOCK theblock;
+  vdisk_read_block(MASTER_BLOCK_REFERENCE, &theblock);
+  theblock.master.flags[MASTER_FORMAT_OFFSET(block_size)] = format;
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &theblock);
+
+  // Allocate master block
+  oufs_allocate_new_block();
+
+  // Allocate the inode blocks (but not the inodes) and any bitmap blocks
+  for (int i = 0; i < layout.n_inode_blocks + layout.n_bitmap_blocks; i++)
+    oufs_allocate_new_block();
+
+  // Allocate first data block
+  BLOCK_REFERENCE first_data_block = oufs_allocate_new_block();
+
+  // Allocate the first inode
+  INODE_REFERENCE ref = oufs_allocate_new_inode();
+
+  // Set the first inode
+  INODE root;
+  root.type = IT_DIRECTORY;
+  root.n_references = 1;
+  root.data[0] = first_data_block;
+  for (int i = 1; i < BLOCKS_PER_INODE; i++)
+    root.data[i] = UNALLOCATED_BLOCK;
+  root.size = 2;
+  oufs_write_inode_by_reference(ref, &root);
+
+  // Make the directory in the first open data
+  vdisk_read_block(first_data_block, &theblock);
+  oufs_clean_directory_block(ref, ref, &theblock);
+  vdisk_write_block(first_data_block, &theblock);
+
+  // Close the virtual disk
+  vdisk_disk_close();
+
+  return 0;
+}
+
+/**
+ * Find a name among the first n_entries entries of a directory block (see
+ * oufs_find_directory_entry()).  It is always inlined, so that a constant
+ * n_entries gives a loop of fixed length, and a constant wide a loop that
+ * reads references at their stored width.
+ */
+static inline __attribute__((always_inline))
+int oufs_scan_directory(BLOCK *block, char *name, int n_entries, int wide)
+{
+  int len = strnlen(name, (wide ? WIDE_FILE_NAME_SIZE : FILE_NAME_SIZE) - 1);
+
+#ifdef __SSE2__
+  if (sizeof(DIRECTORY_ENTRY) == 16)
+  {
+    // The key: the name and its terminator, followed by don't-care bytes
+    char key_bytes[16];
+    memset(key_bytes, 0, sizeof(key_bytes));
+    memcpy(key_bytes, name, len);
+    __m128i key = _mm_loadu_si128((__m128i *) key_bytes);
+    int mask = (1 << (len + 1)) - 1;
+
+    for (int i = 0; i < n_entries; i++)
+    {
+      __m128i entry = _mm_loadu_si128((__m128i *) &block->directory.entry[i]);
+      int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(entry, key));
+      if ((equal & mask) == mask && oufs_entry_inode_as(block, i, wide) != UNALLOCATED_INODE)
+        return i;
+    }
+    return -1;
+  }
+#endif
+
+  for (int i = 0; i < n_entries; i++)
+  {
+    if (!memcmp(block->directory.entry[i].name, name, len)
+        && block->directory.entry[i].name[len] == '\0'
+        && oufs_entry_inode_as(block, i, wide) != UNALLOCATED_INODE)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Pick the scan for the block size of the open disk (see
+ * oufs_find_directory_entry())
+ */
+static inline __attribute__((always_inline))
+int oufs_scan_directory_sized(BLOCK *block, char *name, int wide)
+{
+  switch (geometry.block_size)
+  {
+  case 256:
+    return oufs_scan_directory(block, name, DIRECTORY_ENTRIES_PER_BLOCK(256), wide);
+  case 512:
+    return oufs_scan_directory(block, name, DIRECTORY_ENTRIES_PER_BLOCK(512), wide);
+  case 1024:
+    return oufs_scan_directory(block, name, DIRECTORY_ENTRIES_PER_BLOCK(1024), wide);
+  case 4096:
+    return oufs_scan_directory(block, name, DIRECTORY_ENTRIES_PER_BLOCK(4096), wide);
+  default:
+    return oufs_scan_directory(block, name, geometry.entries_per_block, wide);
+  }
+}
+
+/**
+ * Find a name in a directory block.  Only the bytes up to and including
+ * the name's terminator are compared, since the rest of a name field may
+ * hold leftovers.  With SSE2 each entry is matched with a single 16-byte
+ * compare.  The usual block sizes each have a scan of their own (as with
+ * vdisk_copy_block()), for each width of references; other sizes take the
+ * generic one.
+ * @param block directory block to search
+ * @param name name to look for (only as much of it as fits a name field
+ *   counts)
+ * @return the slot of the first allocated entry with that name, or -1
+ */
+int oufs_find_directory_entry(BLOCK *block, char *name)
+{
+  if (geometry.wide)
+    return oufs_scan_directory_sized(block, name, 1);
+  return oufs_scan_directory_sized(block, name, 0);
+}
+
+/**********************************************************************/
+// Directory blocks and their index
+//
+// A directory starts out as the single block in data[0].  On disks in
+// OUFS_FORMAT_DIRINDEX, a full directory block is split in two by name
+// hash, and the directory's DIR_INDEX_BLOCK records which block holds
+// which hashes, so a name is found by reading the root of the index (and
+// at most one second-level index block) and then one directory block.
+
+static void oufs_reserve_file_blocks(INODE *inode, OUFS_MAP_CACHE *map,
+                                     int first_index, int last_index,
+                                     BLOCK_REFERENCE *refs, char *fresh);
+
+// Where a name hash leads in a directory's index
+typedef struct dir_index_path_s
+{
+  // Index block holding the record, and the record's position in it
+  int node;
+  int position;
+
+  // Directory block the record refers to
+  int leaf;
+} DIR_INDEX_PATH;
+
+// A directory entry that may move when its block is split
+typedef struct dir_split_entry_s
+{
+  unsigned int hash;
+  int slot;
+} DIR_SPLIT_ENTRY;
+
+/**
+ * @param name name of a directory entry
+ * @return the hash the directory index files the name under (32-bit FNV-1a)
+ */
+static unsigned int oufs_name_hash(char *name)
+{
+  unsigned int hash = 2166136261u;
+  int len = oufs_name_size() - 1;
+  for (int i = 0; i < len && name[i] != '\0'; i++)
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  return hash;
+}
+
+/**
+ * Start working on a directory's blocks
+ * @param dir context to set up
+ * @param ref inode of the directory
+ * @return 0 if success, -1 if ref is not a directory
+ */
+static int oufs_dir_open(DIR_CONTEXT *dir, INODE_REFERENCE ref)
+{
+  dir->ref = ref;
+  oufs_map_init(&dir->map);
+  if (oufs_read_inode_by_reference(ref, &dir->inode) != 0
+      || dir->inode.type != IT_DIRECTORY)
+    return -1;
+  return 0;
+}
+
+/**
+ * Finish working on a directory's blocks: write back the indirect blocks
+ * and the references to any blocks added to it
+ * @param dir context from oufs_dir_open()
+ */
+static void oufs_dir_close(DIR_CONTEXT *dir)
+{
+  oufs_map_flush(&dir->map);
+
+  // Only the block references: the entry count may have moved on since
+  INODE inode;
+  oufs_read_inode_by_reference(dir->ref, &inode);
+  memcpy(inode.data, dir->inode.data, sizeof(inode.data));
+  oufs_write_inode_by_reference(dir->ref, &inode);
+}
+
+/**
+ * @param dir directory
+ * @return 1 if the directory has an index (and more than one block)
+ */
+static int oufs_dir_indexed(DIR_CONTEXT *dir)
+{
+  return oufs_map_block(&dir->inode, DIR_INDEX_ROOT, &dir->map) != UNALLOCATED_BLOCK;
+}
+
+/**
+ * Read one of a directory's blocks
+ * @param dir directory
+ * @param index which of its blocks
+ * @param block where to put the contents
+ * @param ref set to the disk block, if not NULL
+ * @return 0 if success, -1 if the directory has no such block
+ */
+static int oufs_dir_read(DIR_CONTEXT *dir, int index, BLOCK *block, BLOCK_REFERENCE *ref)
+{
+  BLOCK_REFERENCE block_ref = oufs_map_block(&dir->inode, index, &dir->map);
+  if (ref != NULL)
+    *ref = block_ref;
+  if (block_ref == UNALLOCATED_BLOCK)
+    return -1;
+  return vdisk_read_block(block_ref, block);
+}
+
+/**
+ * Write one of a directory's blocks
+ * @param dir directory
+ * @param index which of its blocks
+ * @param block new contents
+ * @return 0 if success, -1 if the directory has no such block
+ */
+static int oufs_dir_write(DIR_CONTEXT *dir, int index, BLOCK *block)
+{
+  BLOCK_REFERENCE block_ref = oufs_map_block(&dir->inode, index, &dir->map);
+  if (block_ref == UNALLOCATED_BLOCK)
+    return -1;
+  return vdisk_write_block(block_ref, block);
+}
+
+/**
+ * Add a block to the end of an indexed directory.  It starts out as a
+ * directory block with no entries, whatever the disk held there before.
+ * @param dir directory
+ * @return which of the directory's blocks it is, or -1 if the disk is full
+ */
+static int oufs_dir_add_block(DIR_CONTEXT *dir)
+{
+  BLOCK root;
+  BLOCK empty;
+  BLOCK_REFERENCE ref;
+  char fresh;
+
+  if (oufs_dir_read(dir, DIR_INDEX_ROOT, &root, NULL) != 0)
+    return -1;
+  int index = root.dir_index.n_blocks;
+  oufs_reserve_file_blocks(&dir->inode, &dir->map, index, index, &ref, &fresh);
+  if (ref == UNALLOCATED_BLOCK)
+    return -1;
+
+  for (int i = 0; i < geometry.entries_per_block; i++)
+    oufs_clean_directory_entry(&empty, i);
+  vdisk_write_block(ref, &empty);
+
+  root.dir_index.n_blocks++;
+  oufs_dir_write(dir, DIR_INDEX_ROOT, &root);
+  return index;
+}
+
+/**
+ * Take back blocks added to the end of an indexed directory, along with
+ * any indirect blocks they needed
+ * @param dir directory
+ * @param first first block to take back; the directory is left with this
+ *   many blocks
+ * @param last last block that may have been added
+ */
+static void oufs_dir_remove_blocks(DIR_CONTEXT *dir, int first, int last)
+{
+  BLOCK root;
+  OUFS_RELEASE_BATCH batch;
+  batch.n_refs = 0;
+
+  for (int index = first; index <= last; index++)
+  {
+    BLOCK_REFERENCE ref = oufs_map_block(&dir->inode, index, &dir->map);
+    if (ref == UNALLOCATED_BLOCK)
+      continue;
+    oufs_map_set(&dir->inode, index, UNALLOCATED_BLOCK, &dir->map);
+    oufs_release_add(&batch, ref);
+  }
+  oufs_prune_indirect(&dir->inode, &dir->map, first, last, &batch);
+  oufs_map_flush(&dir->map);
+  oufs_release_batch(&batch);
+
+  if (oufs_dir_read(dir, DIR_INDEX_ROOT, &root, NULL) == 0)
+  {
+    root.dir_index.n_blocks = first;
+    oufs_dir_write(dir, DIR_INDEX_ROOT, &root);
+  }
+}
+
+/**
+ * Give a single-block directory an index, with block 0 covering every hash
+ * @param dir directory
+ * @return 0 if success, -1 if the disk is full
+ */
+static int oufs_dir_create_index(DIR_CONTEXT *dir)
+{
+  BLOCK root;
+  BLOCK_REFERENCE ref;
+  char fresh;
+
+  oufs_reserve_file_blocks(&dir->inode, &dir->map, DIR_INDEX_ROOT, DIR_INDEX_ROOT, &ref, &fresh);
+  if (ref == UNALLOCATED_BLOCK)
+    return -1;
+
+  memset(&root, 0, sizeof(root));
+  root.dir_index.n_records = 1;
+  root.dir_index.n_blocks = DIR_INDEX_ROOT + 1;
+  root.dir_index.record[0].hash = 0;
+  root.dir_index.record[0].block = 0;
+  return oufs_dir_write(dir, DIR_INDEX_ROOT, &root);
+}
+
+/**
+ * Find the record covering a hash in an index block
+ * @param index index block
+ * @param hash name hash
+ * @return position of the last record whose hash is at most hash
+ */
+static int oufs_index_search(DIR_INDEX_BLOCK *index, unsigned int hash)
+{
+  int low = 0;
+  int high = index->n_records - 1;
+  while (low < high)
+  {
+    int mid = (low + high + 1) / 2;
+    if (index->record[mid].hash <= hash)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return low;
+}
+
+/**
+ * Insert a record into an index block, which must have room for it
+ * @param index index block
+ * @param position where the record goes
+ * @param hash first hash the record covers
+ * @param block block the record refers to
+ */
+static void oufs_index_insert(DIR_INDEX_BLOCK *index, int position,
+                              unsigned int hash, unsigned int block)
+{
+  memmove(&index->record[position + 1], &index->record[position],
+          (index->n_records - position) * sizeof(DIR_INDEX_RECORD));
+  index->record[position].hash = hash;
+  index->record[position].block = block;
+  index->n_records++;
+}
+
+/**
+ * Follow a hash down an indexed directory's index
+ * @param dir directory
+ * @param hash name hash
+ * @param path filled in with the directory block covering the hash, and
+ *   the index record that says so
+ * @return 0 if success, -1 if error
+ */
+static int oufs_index_walk(DIR_CONTEXT *dir, unsigned int hash, DIR_INDEX_PATH *path)
+{
+  BLOCK block;
+  if (oufs_dir_read(dir, DIR_INDEX_ROOT, &block, NULL) != 0)
+    return -1;
+  path->node = DIR_INDEX_ROOT;
+  path->position = oufs_index_search(&block.dir_index, hash);
+
+  if (block.dir_index.levels > 0)
+  {
+    path->node = block.dir_index.record[path->position].block;
+    if (oufs_dir_read(dir, path->node, &block, NULL) != 0)
+      return -1;
+    path->position = oufs_index_search(&block.dir_index, hash);
+  }
+
+  path->leaf = block.dir_index.record[path->position].block;
+  return 0;
+}
+
+/**
+ * @param dir directory
+ * @param index one of its blocks
+ * @return 1 if the block holds directory entries, 0 if it is part of the
+ *   index, -1 if the directory has no such block
+ */
+static int oufs_dir_is_entry_block(DIR_CONTEXT *dir, int index)
+{
+  if (index == 0)
+    return 1;
+
+  BLOCK root;
+  if (!oufs_dir_indexed(dir) || oufs_dir_read(dir, DIR_INDEX_ROOT, &root, NULL) != 0
+      || index >= (int) root.dir_index.n_blocks)
+    return -1;
+  if (index == DIR_INDEX_ROOT)
+    return 0;
+  if (root.dir_index.levels > 0)
+  {
+    for (int i = 0; i < root.dir_index.n_records; i++)
+      if (root.dir_index.record[i].block == (unsigned int) index)
+        return 0;
+  }
+  return 1;
+}
+
+/**
+ * Look for a name in a directory.  Without an index there is only block
+ * 0; with one, the name's hash picks the block.  "." and ".." are always
+ * in block 0.
+ * @param dir directory
+ * @param name name to look for (at most FILE_NAME_SIZE-1 characters)
+ * @param lookup filled in with the block the name is (or would be) in,
+ *   the slot holding it and the first free slot
+ * @return 0 if success, -1 if error
+ */
+static int oufs_dir_find(DIR_CONTEXT *dir, char *name, OUFS_LOOKUP *lookup)
+{
+  lookup->parent = dir->ref;
+  lookup->block_index = 0;
+  lookup->entry = -1;
+  lookup->child = UNALLOCATED_INODE;
+  lookup->free_entry = -1;
+
+  if (strcmp(name, ".") && strcmp(name, "..") && oufs_dir_indexed(dir))
+  {
+    DIR_INDEX_PATH path;
+    if (oufs_index_walk(dir, oufs_name_hash(name), &path) != 0)
+      return -1;
+    lookup->block_index = path.leaf;
+  }
+
+  if (oufs_dir_read(dir, lookup->block_index, &lookup->block, &lookup->block_ref) != 0)
+    return -1;
+  lookup->entry = oufs_find_directory_entry(&lookup->block, name);
+  if (lookup->entry >= 0)
+    lookup->child = oufs_entry_inode(&lookup->block, lookup->entry);
+  lookup->free_entry = oufs_free_entry(&lookup->block);
+  return 0;
+}
+
+/* qsort comparison function: split entries by hash */
+static int oufs_split_entry_cmp(const void *a, const void *b)
+{
+  const DIR_SPLIT_ENTRY *ea = a;
+  const DIR_SPLIT_ENTRY *eb = b;
+  if (ea->hash != eb->hash)
+    return (ea->hash < eb->hash) ? -1 : 1;
+  return ea->slot - eb->slot;
+}
+
+/**
+ * Split a full directory block: the entries with the upper half of its
+ * hashes move to a new block, and the index gets a record for it.  A full
+ * index block is split as well; a full root is first pushed down into a
+ * second-level block.  Every block needed is allocated before anything is
+ * changed, so running out of space leaves the directory as it was.
+ * @param dir indexed directory
+ * @param path where the full block's record is, from oufs_index_walk()
+ * @return 0 if success, -1 if the directory cannot grow
+ */
+static int oufs_dir_split(DIR_CONTEXT *dir, DIR_INDEX_PATH *path)
+{
+  BLOCK root, node, leaf, new_leaf;
+
+  if (oufs_dir_read(dir, DIR_INDEX_ROOT, &root, NULL) != 0
+      || oufs_dir_read(dir, path->node, &node, NULL) != 0
+      || oufs_dir_read(dir, path->leaf, &leaf, NULL) != 0)
+    return -1;
+
+  int node_full = node.dir_index.n_records == geometry.index_records;
+  int push_down = node_full && path->node == DIR_INDEX_ROOT;
+  if (node_full && !push_down && root.dir_index.n_records == geometry.index_records)
+    return -1;
+
+  // Order the entries by hash ("." and ".." stay in block 0)
+  DIR_SPLIT_ENTRY entries[DIRECTORY_ENTRIES_PER_BLOCK(VDISK_MAX_BLOCK_SIZE)];
+  int n_entries = 0;
+  for (int i = 0; i < geometry.entries_per_block; i++)
+  {
+    DIRECTORY_ENTRY *entry = &leaf.directory.entry[i];
+    if (oufs_entry_inode(&leaf, i) == UNALLOCATED_INODE
+        || (path->leaf == 0 && (!strcmp(entry->name, ".") || !strcmp(entry->name, ".."))))
+      continue;
+    entries[n_entries].hash = oufs_name_hash(entry->name);
+    entries[n_entries].slot = i;
+    n_entries++;
+  }
+  qsort(entries, n_entries, sizeof(DIR_SPLIT_ENTRY), oufs_split_entry_cmp);
+
+  // Split as near the middle as possible without dividing a hash
+  int split = -1;
+  for (int d = 0; d < n_entries && split < 0; d++)
+  {
+    int candidates[2] = {n_entries / 2 + d, n_entries / 2 - d};
+    for (int c = 0; c < 2; c++)
+      if (candidates[c] > 0 && candidates[c] < n_entries
+          && entries[candidates[c]].hash != entries[candidates[c] - 1].hash)
+      {
+        split = candidates[c];
+        break;
+      }
+  }
+  if (split < 0)
+    return -1;
+  unsigned int split_hash = entries[split].hash;
+
+  // Allocate everything up front, and give it all back if the disk runs
+  //  out part way
+  int old_n_blocks = root.dir_index.n_blocks;
+  int new_blocks[3];
+  int n_new = 1 + node_full + push_down;
+  for (int i = 0; i < n_new; i++)
+  {
+    new_blocks[i] = oufs_dir_add_block(dir);
+    if (new_blocks[i] < 0)
+    {
+      oufs_dir_remove_blocks(dir, old_n_blocks, old_n_blocks + n_new - 1);
+      return -1;
+    }
+  }
+  oufs_dir_read(dir, DIR_INDEX_ROOT, &root, NULL);
+  if (path->node == DIR_INDEX_ROOT)
+    node = root;
+
+  // Move the upper half of the entries (entries are the same size in
+  //  both layouts, so they are copied whole)
+  for (int i = 0; i < geometry.entries_per_block; i++)
+    oufs_clean_directory_entry(&new_leaf, i);
+  for (int i = split; i < n_entries; i++)
+  {
+    new_leaf.directory.entry[i - split] = leaf.directory.entry[entries[i].slot];
+    oufs_clean_directory_entry(&leaf, entries[i].slot);
+  }
+  oufs_dir_write(dir, path->leaf, &leaf);
+  oufs_dir_write(dir, new_blocks[0], &new_leaf);
+
+  int position = path->position + 1;
+  if (push_down)
+  {
+    // The root's records move down a level, under a single root record
+    node.dir_index.levels = 0;
+    node.dir_index.n_blocks = 0;
+    path->node = new_blocks[1];
+    root.dir_index.levels = 1;
+    root.dir_index.n_records = 1;
+    root.dir_index.record[0].hash = 0;
+    root.dir_index.record[0].block = path->node;
+  }
+
+  if (node_full)
+  {
+    // Give the upper half of the records to a new index block
+    BLOCK upper;
+    int half = geometry.index_records / 2;
+    memset(&upper, 0, sizeof(upper));
+    upper.dir_index.n_records = node.dir_index.n_records - half;
+    memcpy(upper.dir_index.record, &node.dir_index.record[half],
+           upper.dir_index.n_records * sizeof(DIR_INDEX_RECORD));
+    node.dir_index.n_records = half;
+    oufs_index_insert(&root.dir_index,
+                      oufs_index_search(&root.dir_index, node.dir_index.record[0].hash) + 1,
+                      upper.dir_index.record[0].hash, new_blocks[n_new - 1]);
+
+    if (position > half)
+      oufs_index_insert(&upper.dir_index, position - half, split_hash, new_blocks[0]);
+    else
+      oufs_index_insert(&node.dir_index, position, split_hash, new_blocks[0]);
+    oufs_dir_write(dir, new_blocks[n_new - 1], &upper);
+    oufs_dir_write(dir, path->node, &node);
+    oufs_dir_write(dir, DIR_INDEX_ROOT, &root);
   }
-  // Error case
-  return(-1);
+  else
+  {
+    oufs_index_insert(&node.dir_index, position, split_hash, new_blocks[0]);
+    oufs_dir_write(dir, path->node, &node);
+  }
+  return 0;
 }
 
 /**
- *  Given an inode reference, write the inode to the virtual disk.
- *
- *  @param i Inode reference (index into the inode list)
- *  @param inode Pointer to an inode memory structure.  This structure will be
- *                written to the disk)
- *  @return 0 = successfully wrote the inode
- *         -1 = an error has occurred
- *
+ * Make room for the name found missing by oufs_lookup_parent().  If its
+ * directory block is full, the directory grows (on disks that allow it)
+ * and the lookup is redone.
+ * @param lookup result of oufs_lookup_parent(); on success it has a free slot
+ * @return 0 if success, -1 if the directory is full
  */
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+static int oufs_make_room(OUFS_LOOKUP *lookup)
 {
-  if(debug)
-    fprintf(stderr, "Writing inode %d\n", i);
+  if (lookup->free_entry >= 0)
+    return 0;
+  if (oufs_inode_format() < OUFS_FORMAT_DIRINDEX)
+    return -1;
 
-  // Find the address of the inode block and the inode within the block
-  BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-  int element = (i % INODES_PER_BLOCK);
+  DIR_CONTEXT dir;
+  DIR_INDEX_PATH path;
+  if (oufs_dir_open(&dir, lookup->parent) != 0)
+    return -1;
 
-  BLOCK b;
-  if(vdisk_read_block(block, &b) == 0) {
-    // Successfully loaded the block: copy just this inode
-    b.inodes.inode[element] = *inode;
-    vdisk_write_block(block, &b);
-    return(0);
-  }
-  // Error case
-  return(-1);
+  int ret = -1;
+  if ((oufs_dir_indexed(&dir) || oufs_dir_create_index(&dir) == 0)
+      && oufs_index_walk(&dir, oufs_name_hash(lookup->name), &path) == 0
+      && oufs_dir_split(&dir, &path) == 0
+      && oufs_dir_find(&dir, lookup->name, lookup) == 0
+      && lookup->free_entry >= 0)
+    ret = 0;
+
+  oufs_dir_close(&dir);
+  return ret;
 }
 
 /**
- *  Given a byte, find the first open bit. That is, the first 0 from the right
- *
- *  @param value the byte to check
- *  @return index of the first 0, 0 being the rightmost bit
- *         -1 = an error has occurred
+ * Remove a name from a directory
+ * @param parent directory
+ * @param name name to remove
+ * @param child inode the name must refer to
+ * @return 0 if success, -1 if the directory has no such entry
  */
-int oufs_find_open_bit(unsigned char value)
+static int oufs_remove_entry(INODE_REFERENCE parent, char *name, INODE_REFERENCE child)
 {
-  int first = 0;
+  DIR_CONTEXT dir;
+  OUFS_LOOKUP lookup;
+  if (oufs_dir_open(&dir, parent) != 0)
+    return -1;
+  if (oufs_dir_find(&dir, name, &lookup) != 0 || lookup.child != child)
+    return -1;
 
-  while (first < 8)
-  {
-    if (!(1 & value))
-      return first;
-    else 
-    {
-      first++;
-      value = value >> 1;
-    }
-  }
+  // Set the entry to unused
+  oufs_dentry_insert(parent, name, UNALLOCATED_INODE);
+  oufs_clean_directory_entry(&lookup.block, lookup.entry);
+  vdisk_write_block(lookup.block_ref, &lookup.block);
 
-	return -1;
+  // Update file count in inode
+  dir.inode.size--;
+  oufs_write_inode_by_reference(parent, &dir.inode);
+  return 0;
 }
 
+/**********************************************************************/
+// Dentry cache
+//
+// Remembers the result of looking up a name in a directory: (directory
+//  inode, name) -> child inode.  A child of UNALLOCATED_INODE records that
+//  the name does not exist.  The cache is direct mapped: a new entry simply
+//  replaces whatever was in its slot.  Everything that adds or removes a
+//  directory entry must update the cache.
+
+#define DENTRY_CACHE_SIZE 256
+
+typedef struct dentry_s
+{
+  int valid;
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char name[FILE_NAME_SIZE];
+} DENTRY;
+
+static DENTRY dentry_cache[DENTRY_CACHE_SIZE];
+
 /**
- * Given the cwd and a path, give a path combining them
- * @param cwd current working directory
- * @param path working path
- * @param rel_path the thing we're outputting
+ * Slot of the dentry cache used by (parent, name)
  */
-void oufs_relative_path(char* cwd, char* path, char* rel_path)
+static DENTRY *oufs_dentry_slot(INODE_REFERENCE parent, char *name)
 {
-  if (!strcmp(path, ""))
-    // Path is blank so just use the cwd
-    strcat(rel_path, cwd);
-  else 
-  {
-    // Path is supplied so use that
-    // check if supplied path is relative 
-    if (path[0] == '/')
-    {
-      // path is absolute, no further work need by done
-      strcat(rel_path, path);
-    }
-    else
-    {
-      // Path is relative. Concat cwd and path into list_dir
-      memset(rel_path, 0, MAX_PATH_LENGTH);
-      strcat(rel_path, cwd);
-      strcat(rel_path, "/");
-      strcat(rel_path, path);
-    }
-  }
+  // FNV-1a over the name, seeded with the parent
+  unsigned int hash = 2166136261u ^ parent;
+  for (int i = 0; i < FILE_NAME_SIZE && name[i] != '\0'; i++)
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  return &dentry_cache[hash & (DENTRY_CACHE_SIZE - 1)];
 }
 
 /**
- *  Format the disk given a virtual disk name
- * 
- *  @param virtual_disk_name name of the virtual disk
- *  @return success code
+ * Look up (parent, name) in the dentry cache
+ * @param parent inode of the directory
+ * @param name entry name (already truncated to FILE_NAME_SIZE-1)
+ * @param child set to the cached child (UNALLOCATED_INODE if known not to exist)
+ * @return 1 if the cache knows the answer, 0 if not
  */
-int oufs_format_disk(char  *virtual_disk_name)
+static int oufs_dentry_lookup(INODE_REFERENCE parent, char *name, INODE_REFERENCE *child)
 {
-  // Open virtual disk
-  vdisk_disk_open(virtual_disk_name);
-
-  BLOCK theblock;
-  memset(&theblock, 0, BLOCK_SIZE);
-
-  // Write 0 to every block
-  for (int i = 0; i < N_BLOCKS_IN_DISK; i++)
+  DENTRY *d = oufs_dentry_slot(parent, name);
+  if (d->valid && d->parent == parent && !strncmp(d->name, name, FILE_NAME_SIZE))
   {
-    vdisk_write_block(i, &theblock);
+    *child = d->child;
+    return 1;
   }
+  return 0;
+}
 
-  // Allocate master block
-  oufs_allocate_new_block();
-
-  // Allocate 8 inode blocks, but not the inodes
-  for (int i = 0; i < N_INODE_BLOCKS; i++)
-    oufs_allocate_new_block();
-
-  // Allocate first data block
-  BLOCK_REFERENCE first_data_block = oufs_allocate_new_block();
-
-  // Allocate the first inode
-  INODE_REFERENCE ref = oufs_allocate_new_inode();
-  BLOCK_REFERENCE first_block = 1;
-
-  // Set the first inode
-  vdisk_read_block(first_block, &theblock);
-  theblock.inodes.inode[0].type = IT_DIRECTORY;
-  theblock.inodes.inode[0].n_references = 1;
-  theblock.inodes.inode[0].data[0] = N_INODE_BLOCKS + 1;
-  for (int i = 1; i < BLOCKS_PER_INODE; i++)
-    theblock.inodes.inode[0].data[i] = UNALLOCATED_BLOCK;
-  theblock.inodes.inode[0].size = 2;
-  vdisk_write_block(first_block, &theblock);
+/**
+ * Record that name in directory parent is child (UNALLOCATED_INODE if the
+ * name does not exist)
+ */
+void oufs_dentry_insert(INODE_REFERENCE parent, char *name, INODE_REFERENCE child)
+{
+  DENTRY *d = oufs_dentry_slot(parent, name);
+  d->valid = 1;
+  d->parent = parent;
+  d->child = child;
+  memset(d->name, '\0', FILE_NAME_SIZE);
+  strncpy(d->name, name, FILE_NAME_SIZE-1);
+}
 
-  // Make the directory in the first open data
-  vdisk_read_block(first_data_block, &theblock);
-  oufs_clean_directory_block(ref, ref, &theblock);
-  vdisk_write_block(first_data_block, &theblock);
+/**
+ * Forget every cached entry inside directory parent (used when the
+ * directory itself goes away and its inode may be reused)
+ */
+void oufs_dentry_purge_directory(INODE_REFERENCE parent)
+{
+  for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+    if (dentry_cache[i].valid && dentry_cache[i].parent == parent)
+      dentry_cache[i].valid = 0;
+}
 
-  // Close the virtual disk
-  vdisk_disk_close();
+/**
+ * Forget the whole dentry cache (it is also forgotten when the disk closes)
+ */
+void oufs_dentry_reset()
+{
+  for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+    dentry_cache[i].valid = 0;
+}
 
-  return 0;
+/**
+ * Look up one path component in a directory, going through the dentry cache
+ * @param dir inode of the directory to search
+ * @param name component name (already truncated to FILE_NAME_SIZE-1)
+ * @param child set to the inode of the entry, if found
+ * @return 1 if the entry exists, 0 if not
+ */
+static int oufs_lookup_component(INODE_REFERENCE dir, char *name, INODE_REFERENCE *child)
+{
+  if (oufs_dentry_lookup(dir, name, child))
+    return *child != UNALLOCATED_INODE;
+
+  // Not cached: match the name against the directory block it belongs in
+  DIR_CONTEXT context;
+  OUFS_LOOKUP lookup;
+  INODE_REFERENCE found = UNALLOCATED_INODE;
+  if (oufs_dir_open(&context, dir) == 0 && oufs_dir_find(&context, name, &lookup) == 0)
+    found = lookup.child;
+
+  // Remember the answer, including a miss
+  oufs_dentry_insert(dir, name, found);
+  *child = found;
+  return found != UNALLOCATED_INODE;
 }
 
 /**
@@ -451,83 +2210,53 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
   oufs_relative_path(cwd, path, listdir);
 
   // Declare some variables
-  BLOCK_REFERENCE current_block = N_INODE_BLOCKS + 1;
-  BLOCK theblock;
   INODE_REFERENCE ref = 0;
   INODE_REFERENCE lastref = 0;
 
   // Tokenize the path
-  INODE inode;
-  char *token = strtok(listdir, "/");
+  char *save;
+  char *token = strtok_r(listdir, "/", &save);
   char lasttoken[FILE_NAME_SIZE];
   memset(lasttoken, '\0', FILE_NAME_SIZE);
   lasttoken[0] = '/';
   while (token != NULL)
   {
-    // Check if the expected token exists in this directory
-    int flag = 0;
-    vdisk_read_block(current_block, &theblock);
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    // Only directories can be descended into
+    if (oufs_inode_type(ref) != IT_DIRECTORY)
     {
-      if (theblock.directory.entry[i].inode_reference != UNALLOCATED_INODE)
-      {
-        char token_trunc[FILE_NAME_SIZE];
-        memset(token_trunc, '\0', FILE_NAME_SIZE);
-        strncpy(token_trunc, token, FILE_NAME_SIZE-1);
-        oufs_read_inode_by_reference(theblock.directory.entry[i].inode_reference, &inode);
-        if (!strcmp(theblock.directory.entry[i].name, token_trunc))
-        {
-          // found it!
-          flag = 1;
-          lastref = ref;
-          ref = theblock.directory.entry[i].inode_reference;
-
-          // load the inode
-          oufs_read_inode_by_reference(ref, &inode);
-
-          if (inode.type == IT_DIRECTORY)
-          {
-            // Grab the next level block reference
-            current_block = inode.data[0];
-          }
-          else
-          {
-            // flag 2 signifies that we matched a file
-            flag == 2;
-          }
-        }
-      }
-    } // end for
+      if (debug)
+        fprintf(stderr, "find_file: can't descend into file\n");
+      return 0;
+    }
 
-    if (flag == 0)
+    // Check if the expected token exists in this directory (names are
+    //  truncated to fit the disk's entries)
+    char token_trunc[FILE_NAME_SIZE];
+    memset(token_trunc, '\0', FILE_NAME_SIZE);
+    strncpy(token_trunc, token, oufs_name_size() - 1);
+
+    INODE_REFERENCE next;
+    if (!oufs_lookup_component(ref, token_trunc, &next))
     {
       if (debug)
         fprintf(stderr, "find_file: directory does not exist\n");
       *child = -1;
       *parent = -1;
-      memset(lasttoken, '\0', FILE_NAME_SIZE);
       return 0;
     }
+    lastref = ref;
+    ref = next;
 
     // Save the token into the last token variable
-    memset(lasttoken, '\0', FILE_NAME_SIZE);
-    strncpy(lasttoken, token, FILE_NAME_SIZE-1);
+    strncpy(lasttoken, token_trunc, FILE_NAME_SIZE);
     // Try to get the next token
-    token = strtok(NULL, "/");
-
-    // If the found file is a file and there are more tokens, findfile failed.
-    if (flag == 2 && token != NULL)
-    {
-      if (debug)
-        fprintf(stderr, "find_file: can't descend into file\n");
-      return 0;
-    }
+    token = strtok_r(NULL, "/", &save);
   } // end while
 
   // We're at the end of the path and we have presumably found the file. set the return values
   *child = ref;
   *parent = lastref;
-  strncpy(local_name, lasttoken, FILE_NAME_SIZE-1);
+  strncpy(local_name, lasttoken, FILE_NAME_SIZE);
 
   if (debug)
   {
@@ -539,6 +2268,200 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
   return 1;
 }
 
+/**
+ * Start reading the entries of a directory
+ * @param ref inode of the directory
+ * @return the open directory, or NULL if ref is not a directory (or memory
+ *   runs out)
+ */
+static OUFS_DIR *oufs_open_directory(INODE_REFERENCE ref)
+{
+  OUFS_DIR *dir = malloc(sizeof(OUFS_DIR));
+  if (dir == NULL)
+    return NULL;
+  if (oufs_dir_open(&dir->context, ref) != 0)
+  {
+    free(dir);
+    return NULL;
+  }
+  dir->block_index = 0;
+  dir->entry = 0;
+  dir->loaded = 0;
+  return dir;
+}
+
+/**
+ * Open a directory for reading its entries with oufs_readdir()
+ * @param cwd current working directory
+ * @param path absolute or relative path of the directory
+ * @return the open directory, or NULL if path is not a directory (or memory
+ *   runs out)
+ */
+OUFS_DIR *oufs_opendir(char *cwd, char *path)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[FILE_NAME_SIZE];
+
+  if (!oufs_find_file(cwd, path, &parent, &child, local_name))
+    return NULL;
+  return oufs_open_directory(child);
+}
+
+/**
+ * Get the next entry of an open directory.  Only the directory block being
+ * read is held in memory.
+ * @param dir directory from oufs_opendir()
+ * @return the entry, valid until the next call, or NULL after the last one
+ */
+OUFS_DIRENT *oufs_readdir(OUFS_DIR *dir)
+{
+  while (1)
+  {
+    // Move on to the next directory block
+    if (dir->entry == geometry.entries_per_block)
+    {
+      dir->block_index++;
+      dir->entry = 0;
+      dir->loaded = 0;
+    }
+    if (!dir->loaded)
+    {
+      int kind = oufs_dir_is_entry_block(&dir->context, dir->block_index);
+      if (kind < 0)
+        return NULL;
+      if (kind == 0 || oufs_dir_read(&dir->context, dir->block_index, &dir->block, NULL) != 0)
+      {
+        // Part of the index: nothing to read here
+        dir->entry = geometry.entries_per_block;
+        continue;
+      }
+      dir->loaded = 1;
+    }
+
+    INODE_REFERENCE ref = oufs_entry_inode(&dir->block, dir->entry);
+    DIRECTORY_ENTRY *entry = &dir->block.directory.entry[dir->entry++];
+    if (ref == UNALLOCATED_INODE)
+      continue;
+
+    INODE inode;
+    oufs_read_inode_by_reference(ref, &inode);
+    memcpy(dir->dirent.name, entry->name, FILE_NAME_SIZE);
+    dir->dirent.name[FILE_NAME_SIZE - 1] = '\0';
+    dir->dirent.inode_reference = ref;
+    dir->dirent.type = inode.type;
+    dir->dirent.size = inode.size;
+    return &dir->dirent;
+  }
+}
+
+/**
+ * Finish reading a directory
+ * @param dir directory from oufs_opendir()
+ */
+void oufs_closedir(OUFS_DIR *dir)
+{
+  free(dir);
+}
+
+/**
+ * Fill in the inode fields of a stat result
+ * @param stat result to fill in
+ * @param inode inode it describes
+ */
+static void oufs_stat_inode(OUFS_STAT *stat, INODE *inode)
+{
+  stat->type = inode->type;
+  stat->n_references = inode->n_references;
+  stat->size = inode->size;
+}
+
+/**
+ * Get the attributes of a file or directory
+ * @param cwd current working directory
+ * @param path absolute or relative path
+ * @param stat filled in with the name, the inode and its fields
+ * @return 0 if success, -1 if the path does not exist
+ */
+int oufs_stat(char *cwd, char *path, OUFS_STAT *stat)
+{
+  INODE_REFERENCE parent;
+  INODE inode;
+
+  if (!oufs_find_file(cwd, path, &parent, &stat->inode_reference, stat->name)
+      || oufs_read_inode_by_reference(stat->inode_reference, &inode) != 0)
+    return -1;
+  oufs_stat_inode(stat, &inode);
+  return 0;
+}
+
+/**
+ * Get the attributes of every entry of a directory in one call.  Each
+ * directory block is read once, and the inodes come from the resident
+ * inode table, so no inode costs a disk read.
+ * @param cwd current working directory
+ * @param path absolute or relative path of the directory
+ * @param stats set to an array of results, in the order the entries are
+ *   stored ("." and ".." first); the caller frees it
+ * @return number of entries, or -1 if path is not a directory (or memory
+ *   runs out)
+ */
+int oufs_stat_dir(char *cwd, char *path, OUFS_STAT **stats)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[FILE_NAME_SIZE];
+  DIR_CONTEXT dir;
+
+  if (!oufs_find_file(cwd, path, &parent, &child, local_name)
+      || oufs_dir_open(&dir, child) != 0 || oufs_load_resident() != 0)
+    return -1;
+
+  // Names straight from the directory blocks, attributes from the inodes
+  int max_entries = (dir.inode.size > 0) ? dir.inode.size : 1;
+  int n_entries = 0;
+  OUFS_STAT *result = malloc(max_entries * sizeof(OUFS_STAT));
+  if (result == NULL)
+    return -1;
+  int kind;
+  for (int index = 0; (kind = oufs_dir_is_entry_block(&dir, index)) >= 0; index++)
+  {
+    BLOCK block;
+    if (kind == 0 || oufs_dir_read(&dir, index, &block, NULL) != 0)
+      continue;
+
+    for (int i = 0; i < geometry.entries_per_block; i++)
+    {
+      DIRECTORY_ENTRY *entry = &block.directory.entry[i];
+      INODE_REFERENCE ref = oufs_entry_inode(&block, i);
+      if (ref == UNALLOCATED_INODE)
+        continue;
+      if (n_entries == max_entries)
+      {
+        OUFS_STAT *larger = realloc(result, 2 * max_entries * sizeof(OUFS_STAT));
+        if (larger == NULL)
+        {
+          free(result);
+          return -1;
+        }
+        result = larger;
+        max_entries *= 2;
+      }
+
+      OUFS_STAT *stat = &result[n_entries++];
+      INODE inode;
+      memcpy(stat->name, entry->name, FILE_NAME_SIZE);
+      stat->name[FILE_NAME_SIZE - 1] = '\0';
+      stat->inode_reference = ref;
+      oufs_read_inode_by_reference(ref, &inode);
+      oufs_stat_inode(stat, &inode);
+    }
+  }
+
+  *stats = result;
+  return n_entries;
+}
+
 /* qsort C-string comparison function */ 
 int cstring_cmp(const void *a, const void *b) 
 { 
@@ -549,6 +2472,18 @@ int cstring_cmp(const void *a, const void *b)
 	comparison function */ 
 } 
 
+/**
+ * Free a list of names gathered by oufs_list()
+ * @param names the list
+ * @param n_names number of names in it
+ */
+static void oufs_free_names(char **names, int n_names)
+{
+  for (int i = 0; i < n_names; i++)
+    free(names[i]);
+  free(names);
+}
+
 /**
  * List the files in a directory in alphabetical order
  * @param cwd current working directory
@@ -574,34 +2509,57 @@ int oufs_list(char *cwd, char *path)
   INODE inode;
   oufs_read_inode_by_reference(child, &inode);
 
-  // Get data block pointed to by inode
-  BLOCK_REFERENCE blockref = inode.data[0];
-  BLOCK theblock;
-  vdisk_read_block(blockref, &theblock);
-
   if (inode.type == IT_DIRECTORY)
   {
-    // List the files and directories contained within our dir
-    char* filelist[DIRECTORY_ENTRIES_PER_BLOCK];
+    // List the files and directories contained within our dir, apart
+    //  from . and .., which always come first
+    OUFS_DIR *dir = oufs_open_directory(child);
+    if (dir == NULL)
+      return -1;
+    OUFS_DIRENT *dirent;
+    int maxFiles = geometry.entries_per_block;
+    char** filelist = malloc(maxFiles * sizeof(char*));
+    if (filelist == NULL)
+    {
+      oufs_closedir(dir);
+      return -1;
+    }
     int numFiles = 0;
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    while ((dirent = oufs_readdir(dir)) != NULL)
     {
-      if (theblock.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+      if (!strcmp(dirent->name, ".") || !strcmp(dirent->name, ".."))
+        continue;
+
+      if (numFiles == maxFiles)
+      {
+        char **grown = realloc(filelist, 2 * maxFiles * sizeof(char*));
+        if (grown == NULL)
+        {
+          oufs_free_names(filelist, numFiles);
+          oufs_closedir(dir);
+          return -1;
+        }
+        filelist = grown;
+        maxFiles *= 2;
+      }
+
+      // Add name to the list (with room for the slash)
+      filelist[numFiles] = malloc(FILE_NAME_SIZE + 1);
+      if (filelist[numFiles] == NULL)
       {
-        // Find inode
-        INODE thenode;
-        oufs_read_inode_by_reference(theblock.directory.entry[i].inode_reference, &thenode);
-
-        // Add name to the list
-        filelist[numFiles] = strdup(theblock.directory.entry[i].name);
-          
-        // Add a trailing forward slash if its a directory
-        if (thenode.type == IT_DIRECTORY)
-          strcat(filelist[numFiles], "/");
-
-        numFiles++;
+        oufs_free_names(filelist, numFiles);
+        oufs_closedir(dir);
+        return -1;
       }
+      strcpy(filelist[numFiles], dirent->name);
+
+      // Add a trailing forward slash if its a directory
+      if (dirent->type == IT_DIRECTORY)
+        strcat(filelist[numFiles], "/");
+
+      numFiles++;
     }
+    oufs_closedir(dir);
 
     // Sort list of names
     qsort(filelist, numFiles, sizeof(char*), cstring_cmp);
@@ -609,10 +2567,12 @@ int oufs_list(char *cwd, char *path)
     // Print the sorted list
     printf("./\n");
     printf("../\n");
-    for (int i = 2; i < numFiles; i++)
+    for (int i = 0; i < numFiles; i++)
     {
       printf("%s\n", filelist[i]);
     }
+
+    oufs_free_names(filelist, numFiles);
   }
   else if (inode.type == IT_FILE)
   {
@@ -623,6 +2583,88 @@ int oufs_list(char *cwd, char *path)
   return 0;
 }
 
+/**
+ * Resolve the directory that would contain path, and look for the final
+ * name in it.  The directory is walked once and the block the name
+ * belongs in is read once; the block is handed back so that a caller
+ * creating the name can fill in the free slot and write the block straight
+ * back (after oufs_make_room(), if it is full).
+ * @param cwd current working directory
+ * @param path absolute or relative path of the name to look up
+ * @param lookup filled in with the parent directory, its block, the slot
+ *   holding the name (entry, -1 if absent) and the first free slot
+ *   (free_entry, -1 if the block is full)
+ * @return 1 if the parent directory exists, 0 if not
+ */
+int oufs_lookup_parent(char *cwd, char *path, OUFS_LOOKUP *lookup)
+{
+  // Get relative path
+  char rel_path[MAX_PATH_LENGTH];
+  memset(rel_path, 0, MAX_PATH_LENGTH);
+  oufs_relative_path(cwd, path, rel_path);
+
+  // Get base and directory names (libgen may modify its argument)
+  char dir_buf[MAX_PATH_LENGTH];
+  char base_buf[MAX_PATH_LENGTH];
+  strcpy(dir_buf, rel_path);
+  strcpy(base_buf, rel_path);
+  char* dir = dirname(dir_buf);
+  char* base = basename(base_buf);
+
+  memset(lookup->name, '\0', FILE_NAME_SIZE);
+  strncpy(lookup->name, base, FILE_NAME_SIZE-1);
+  lookup->entry = -1;
+  lookup->free_entry = -1;
+  lookup->child = UNALLOCATED_INODE;
+
+  // The root has no parent
+  if (!strcmp(base, "/"))
+    return 0;
+
+  // Parent directory must exist
+  INODE_REFERENCE grandparent;
+  char local_name[FILE_NAME_SIZE];
+  if (!oufs_find_file("/", dir, &grandparent, &lookup->parent, local_name))
+    return 0;
+  lookup->name[oufs_name_size() - 1] = '\0';
+
+  // Read the directory block the name belongs in once: find the name, and
+  //  the first free slot
+  DIR_CONTEXT dir_context;
+  if (oufs_dir_open(&dir_context, lookup->parent) != 0
+      || oufs_dir_find(&dir_context, lookup->name, lookup) != 0)
+    return 0;
+
+  // Remember what we learned about the name
+  oufs_dentry_insert(lookup->parent, lookup->name, lookup->child);
+  return 1;
+}
+
+/**
+ * Add the name found missing by oufs_lookup_parent() to its directory,
+ * pointing at child.  The directory block is written once and the parent's
+ * entry count is updated.
+ * @param lookup result of oufs_lookup_parent(); must have a free slot
+ * @param child inode the new entry refers to
+ */
+static void oufs_add_entry(OUFS_LOOKUP *lookup, INODE_REFERENCE child)
+{
+  // Set the empty entry to point to our new inode
+  oufs_entry_set(&lookup->block, lookup->free_entry, lookup->name, child);
+  vdisk_write_block(lookup->block_ref, &lookup->block);
+  oufs_dentry_insert(lookup->parent, lookup->name, child);
+
+  lookup->entry = lookup->free_entry;
+  lookup->child = child;
+  lookup->free_entry = -1;
+
+  // Update file count in inode
+  INODE parent_inode;
+  oufs_read_inode_by_reference(lookup->parent, &parent_inode);
+  parent_inode.size++;
+  oufs_write_inode_by_reference(lookup->parent, &parent_inode);
+}
+
 /**
  * makes a directory
  * @param cwd current working directory
@@ -631,35 +2673,19 @@ int oufs_list(char *cwd, char *path)
  */
 int oufs_mkdir(char *cwd, char *path)
 {
-  // Get relative path
-  char rel_path[MAX_PATH_LENGTH];
-  memset(rel_path, 0, MAX_PATH_LENGTH);
-  oufs_relative_path(cwd, path, rel_path);
-
-  // Get base and directory names
-  char* dir = dirname(strdup(rel_path));
-  char* base = basename(strdup(rel_path));
-
-  // Find file outputs
-  INODE_REFERENCE parent;
-  INODE_REFERENCE child;
-  char local_name[FILE_NAME_SIZE];
-
-  INODE_REFERENCE new_dir_parent;
+  OUFS_LOOKUP lookup;
 
   // Parent directory must exist
-  if (!oufs_find_file(cwd, dir, &parent, &child, local_name))
+  if (!oufs_lookup_parent(cwd, path, &lookup))
   {
       // Parent directory does not exist
       if (debug)
         fprintf(stderr, "mkdir: Parent directory does not exist!\n");
       return -1;
   }
-  else
-    new_dir_parent = child;
 
   // Child directory must not exist
-  if (oufs_find_file(cwd, path, &parent, &child, local_name))
+  if (lookup.entry >= 0)
   {
       // Directory we are trying to make already exists
       if (debug)
@@ -667,17 +2693,31 @@ int oufs_mkdir(char *cwd, char *path)
       return -1;
   }
 
+  // There must be room for it
+  if (oufs_make_room(&lookup) != 0)
+  {
+    if (debug)
+      fprintf(stderr, "Directory is full!");
+    return -1;
+  }
+
   // Allocated the new block
   BLOCK_REFERENCE new_dir_block_ref = oufs_allocate_new_block();
+  if (new_dir_block_ref == UNALLOCATED_BLOCK)
+    return -1;
 
   // Make a new inode for the new directory
   INODE_REFERENCE new_inode_ref = oufs_allocate_new_inode();
   if (debug)
     fprintf(stderr, "new inode ref: %d\n", new_inode_ref);
+  if (new_inode_ref == UNALLOCATED_INODE)
+  {
+    oufs_deallocate_block(new_dir_block_ref);
+    return -1;
+  }
 
   // Set the inode for the new directory
   INODE new_inode;
-  oufs_read_inode_by_reference(new_inode_ref, &new_inode);
   new_inode.type = IT_DIRECTORY;
   new_inode.n_references = 1;
   new_inode.data[0] = new_dir_block_ref;
@@ -688,45 +2728,11 @@ int oufs_mkdir(char *cwd, char *path)
 
   // Clean the directory
   BLOCK theblock;
-  vdisk_read_block(new_dir_block_ref, &theblock);
-  oufs_clean_directory_block(new_inode_ref, new_dir_parent, &theblock);
+  oufs_clean_directory_block(new_inode_ref, lookup.parent, &theblock);
   vdisk_write_block(new_dir_block_ref, &theblock);
 
   // Update entries in parent block
-  INODE parent_inode;
-  oufs_read_inode_by_reference(new_dir_parent, &parent_inode);
-  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
-  vdisk_read_block(parent_block_ref, &theblock);
-
-  // Find the first available entry in the block
-  int wrote_entry = 0;
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-  {
-    // Is the directory entry unallocated?
-    if (theblock.directory.entry[i].inode_reference == UNALLOCATED_INODE)
-    {
-      // Set the empty entry to point to our new inode
-      memset(theblock.directory.entry[i].name, '\0', FILE_NAME_SIZE);
-      strncpy(theblock.directory.entry[i].name, base, FILE_NAME_SIZE-1);
-      theblock.directory.entry[i].inode_reference = new_inode_ref;
-      wrote_entry = 1;
-      vdisk_write_block(parent_block_ref, &theblock);
-
-      // Update file count in inode
-      parent_inode.size++;
-      oufs_write_inode_by_reference(new_dir_parent, &parent_inode);
-
-      // Exit the for loop
-      break;
-    }
-  }
-  
-  if (!wrote_entry)
-  {
-    if (debug)
-      fprintf(stderr, "Directory is full!");
-    return -1;
-  }
+  oufs_add_entry(&lookup, new_inode_ref);
 
   return 0;
 }
@@ -790,9 +2796,17 @@ int oufs_rmdir(char *cwd, char *path)
     return -1;
   }
 
+  // A directory that grew past its first block gives the rest back
+  BLOCK_REFERENCE child_block_ref = child_inode.data[0];
+  DIR_CONTEXT child_dir;
+  if (oufs_dir_open(&child_dir, child_inode_ref) == 0 && oufs_dir_indexed(&child_dir))
+  {
+    child_inode.data[0] = UNALLOCATED_BLOCK;
+    oufs_release_file_blocks(&child_inode);
+  }
+
   // Deallocate the block and inode in the master block
   oufs_deallocate_inode(child_inode_ref);
-  BLOCK_REFERENCE child_block_ref = child_inode.data[0];
   oufs_deallocate_block(child_block_ref);
 
   // Remove inode properties
@@ -800,42 +2814,17 @@ int oufs_rmdir(char *cwd, char *path)
   child_inode.type = IT_NONE;
   oufs_write_inode_by_reference(child_inode_ref, &child_inode);
 
-  // Read data for parent of deleted directory
-  INODE parent_inode;
-  oufs_read_inode_by_reference(parent_inode_ref, &parent_inode);
-  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
-  BLOCK parent_block;
-  vdisk_read_block(parent_block_ref, &parent_block);
-
-  // Remove the directory's entry from its parent directory
-  int removed_entry = 0;
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-  {
-    // Does the directory entry point to the one we're deleting?
-    if (parent_block.directory.entry[i].inode_reference == child_inode_ref)
-    {
-      // Set the empty entry to point to our new inode
-      strncpy(parent_block.directory.entry[i].name, "", FILE_NAME_SIZE);
-      parent_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-      removed_entry = 1;
-      vdisk_write_block(parent_block_ref, &parent_block);
-
-      // Update file count in inode
-      parent_inode.size--;
-      oufs_write_inode_by_reference(parent_inode_ref, &parent_inode);
-
-      // Exit the for loop
-      break;
-    }
-  }
+  // Remove the directory's entry from its parent directory.  The name is
+  //  gone, and so is everything that was looked up inside it
+  int removed_entry = oufs_remove_entry(parent_inode_ref, local_name, child_inode_ref) == 0;
+  oufs_dentry_purge_directory(child_inode_ref);
 
   // Reset all directory entries in child
   BLOCK child_block;
   vdisk_read_block(child_block_ref, &child_block);
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+  for (int i = 0; i < geometry.entries_per_block; i++)
   {
-    strncpy(child_block.directory.entry[i].name, "", FILE_NAME_SIZE);
-    child_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
+    oufs_clean_directory_entry(&child_block, i);
 
     child_inode.size = 0;
     vdisk_write_block(child_block_ref, &child_block);
@@ -852,57 +2841,28 @@ int oufs_rmdir(char *cwd, char *path)
 }
 
 /**
- *  Creates an empty file if it doesn't exist yet
- *  @param cwd current working directory
- *  @param path file path to touch
- *  @return status code
- **/
-int oufs_touch(char *cwd, char *path)
+ * Create an empty file under the name found missing by oufs_lookup_parent()
+ * @param lookup result of oufs_lookup_parent()
+ * @return status code
+ */
+static int oufs_create_file(OUFS_LOOKUP *lookup)
 {
-  // Get relative path
-  char rel_path[MAX_PATH_LENGTH];
-  memset(rel_path, 0, MAX_PATH_LENGTH);
-  oufs_relative_path(cwd, path, rel_path);
-
-  // Get base and directory names
-  char* dir = dirname(strdup(rel_path));
-  char* base = basename(strdup(rel_path));
-  
-  // Find file outputs
-  INODE_REFERENCE parent;
-  INODE_REFERENCE child;
-  char local_name[FILE_NAME_SIZE];
-
-  INODE_REFERENCE new_file_parent;
-
-  // Parent directory must exist
-  if (!oufs_find_file(cwd, dir, &parent, &child, local_name))
+  if (oufs_make_room(lookup) != 0)
   {
-      // Parent directory does not exist
-      if (debug)
-        fprintf(stderr, "touch: Parent directory does not exist!\n");
-      return -1;
+    if (debug)
+      fprintf(stderr, "Directory is full!");
+    return -1;
   }
-  else
-    new_file_parent = child;
 
-  // Child directory must not exist
-  if (oufs_find_file(cwd, path, &parent, &child, local_name))
-  {
-      // Directory we are trying to make already exists
-      if (debug)
-        fprintf(stderr, "touch: Directory or file already exists\n");
-      return -1;
-  }
-  
   // Make a new inode for the new file
   INODE_REFERENCE new_inode_ref = oufs_allocate_new_inode();
   if (debug)
     fprintf(stderr, "new inode ref: %d\n", new_inode_ref);
+  if (new_inode_ref == UNALLOCATED_INODE)
+    return -1;
 
   // Set the inode for the new file
   INODE new_inode;
-  oufs_read_inode_by_reference(new_inode_ref, &new_inode);
   new_inode.type = IT_FILE;
   new_inode.n_references = 1;
   for (int i = 0; i < BLOCKS_PER_INODE; i++)
@@ -911,43 +2871,39 @@ int oufs_touch(char *cwd, char *path)
   oufs_write_inode_by_reference(new_inode_ref, &new_inode);
 
   // Update entries in parent block
-  INODE parent_inode;
-  BLOCK theblock;
-  oufs_read_inode_by_reference(new_file_parent, &parent_inode);
-  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
-  vdisk_read_block(parent_block_ref, &theblock);
+  oufs_add_entry(lookup, new_inode_ref);
+  return 0;
+}
+
+/**
+ *  Creates an empty file if it doesn't exist yet
+ *  @param cwd current working directory
+ *  @param path file path to touch
+ *  @return status code
+ **/
+int oufs_touch(char *cwd, char *path)
+{
+  OUFS_LOOKUP lookup;
 
-  // Find the first available entry in the block
-  int wrote_entry = 0;
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+  // Parent directory must exist
+  if (!oufs_lookup_parent(cwd, path, &lookup))
   {
-    // Is the directory entry unallocated?
-    if (theblock.directory.entry[i].inode_reference == UNALLOCATED_INODE)
-    {
-      // Set the empty entry to point to our new inode
-      memset(theblock.directory.entry[i].name, '\0', FILE_NAME_SIZE);
-      strncpy(theblock.directory.entry[i].name, base, FILE_NAME_SIZE-1);
-      theblock.directory.entry[i].inode_reference = new_inode_ref;
-      wrote_entry = 1;
-      vdisk_write_block(parent_block_ref, &theblock);
-
-      // Update file count in inode
-      parent_inode.size++;
-      oufs_write_inode_by_reference(new_file_parent, &parent_inode);
-
-      // Exit the for loop
-      break;
-    }
+      // Parent directory does not exist
+      if (debug)
+        fprintf(stderr, "touch: Parent directory does not exist!\n");
+      return -1;
   }
-  
-  if (!wrote_entry)
+
+  // Child directory must not exist
+  if (lookup.entry >= 0)
   {
-    if (debug)
-      fprintf(stderr, "Directory is full!");
-    return -1;
+      // Directory we are trying to make already exists
+      if (debug)
+        fprintf(stderr, "touch: Directory or file already exists\n");
+      return -1;
   }
 
-  return 0;
+  return oufs_create_file(&lookup);
 }
 
 /**
@@ -964,14 +2920,27 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
   fileError->inode_reference = -1;
   fileError->mode = *mode;
   fileError->offset = -1;
+  fileError->inode_dirty = 0;
+  fileError->buffer_index = -1;
+  fileError->buffer_dirty = 0;
 
-  // Declare find file outputs
-  INODE_REFERENCE parent;
+  // Find the file and, if it is missing, where it would go
+  OUFS_LOOKUP lookup;
   INODE_REFERENCE child;
-  char local_name[FILE_NAME_SIZE];
-
-  // Try to find the file
-  int exists = oufs_find_file(cwd, path, &parent, &child, local_name);
+  int exists;
+  int have_parent = oufs_lookup_parent(cwd, path, &lookup);
+  if (have_parent)
+  {
+    exists = (lookup.entry >= 0);
+    child = lookup.child;
+  }
+  else
+  {
+    // Without a parent directory, only the root itself can exist
+    INODE_REFERENCE parent;
+    char local_name[FILE_NAME_SIZE];
+    exists = oufs_find_file(cwd, path, &parent, &child, local_name);
+  }
 
   if (!exists)
   {
@@ -983,70 +2952,436 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
     }
     else if (*mode == 'w' || *mode == 'a')
     {
-      // Use touch to create the file
-      if (oufs_touch(cwd, path) == -1)
+      // Create the file in the slot the lookup found
+      if (!have_parent || oufs_create_file(&lookup) == -1)
         return fileError;
-
-      // Run find file again to get the correct inode references
-      oufs_find_file(cwd, path, &parent, &child, local_name);
+      child = lookup.child;
     }
   }
   else if (*mode == 'w')
   {
-    BLOCK_REFERENCE data_block_ref;
-    BLOCK data_block;
     INODE inode;
     oufs_read_inode_by_reference(child, &inode);
 
     // If file is open for writing, clear file data first
-    inode.size = 0;
-    for (int i = 0; i < BLOCKS_PER_INODE; i++)
+    oufs_release_file_blocks(&inode);
+    oufs_write_inode_by_reference(child, &inode);
+  }
+
+  // The file opened: the handle set up for errors becomes the real one
+  OUFILE *fp = fileError;
+  fp->inode_reference = child;
+  fp->mode = *mode;
+  oufs_read_inode_by_reference(child, &fp->inode);
+  fp->inode_dirty = 0;
+  fp->buffer_index = -1;
+  fp->buffer_dirty = 0;
+  oufs_map_init(&fp->map);
+
+  // Appending starts at the end of the file
+  if (*mode == 'a')
+    fp->offset = fp->inode.size;
+  else
+    fp->offset = 0;
+  return fp;
+}
+
+/**
+ * Write the file pointer's buffered block and cached inode back to the disk
+ * @param fp file pointer
+ * @return 0 on success, -1 on error
+ */
+int oufs_fflush(OUFILE *fp)
+{
+  if (fp->inode_reference == -1)
+    return -1;
+
+  if (fp->buffer_dirty)
+  {
+    if (vdisk_write_block(fp->buffer_ref, &fp->buffer) != 0)
+      return -1;
+    fp->buffer_dirty = 0;
+  }
+
+  if (oufs_map_flush(&fp->map) != 0)
+    return -1;
+
+  if (fp->inode_dirty)
+  {
+    // Only the block list and size belong to this handle; the rest of the
+    //  inode (e.g. the reference count) may have changed since it was opened
+    INODE inode;
+    if (oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0)
+      return -1;
+    memcpy(inode.data, fp->inode.data, sizeof(inode.data));
+    inode.size = fp->inode.size;
+    if (oufs_write_inode_by_reference(fp->inode_reference, &inode) != 0)
+      return -1;
+    fp->inode_dirty = 0;
+  }
+
+  return 0;
+}
+
+void oufs_fclose(OUFILE *fp)
+{
+  oufs_fflush(fp);
+  free(fp);
+}
+
+/**
+ * Bring block index of a file into the file pointer's buffer, writing back
+ * whatever the buffer held before.  Blocks that were just allocated or lie
+ * entirely past the end of the file hold nothing yet and are not read.
+ * @param fp file pointer
+ * @param index block index in the file
+ * @param ref disk block holding it (must be allocated)
+ * @param fresh 1 if the block was just allocated
+ * @return 0 on success, -1 on error
+ */
+static int oufs_fill_buffer(OUFILE *fp, int index, BLOCK_REFERENCE ref, int fresh)
+{
+  if (fp->buffer_index == index)
+    return 0;
+
+  if (oufs_fflush(fp) != 0)
+    return -1;
+
+  if (!fresh && (index << geometry.block_shift) < (int) fp->inode.size)
+  {
+    if (vdisk_read_block(ref, &fp->buffer) != 0)
+      return -1;
+  }
+  else
+    vdisk_fill_block(&fp->buffer, 0, geometry.block_size);
+
+  fp->buffer_index = index;
+  fp->buffer_ref = ref;
+  return 0;
+}
+
+/**
+ * Make sure that blocks first_index ... last_index of a file are allocated
+ * and find them.  Missing blocks are allocated together, continuing on
+ * from the block before them when possible, so that a file written
+ * sequentially ends up in adjacent blocks.
+ * @param inode inode of the file (updated, not written back)
+ * @param map indirect block cache of the file
+ * @param first_index first block index in the file
+ * @param last_index last block index in the file (at most OUFS_IO_BLOCKS
+ *   after first_index)
+ * @param refs filled in with the disk blocks (UNALLOCATED_BLOCK where the
+ *   disk is full)
+ * @param fresh filled in with 1 for each block allocated here, 0 for
+ *   blocks the file already had
+ */
+static void oufs_reserve_file_blocks(INODE *inode, OUFS_MAP_CACHE *map,
+                                     int first_index, int last_index,
+                                     BLOCK_REFERENCE *refs, char *fresh)
+{
+  BLOCK_REFERENCE new_refs[OUFS_IO_BLOCKS];
+  int n_blocks = last_index - first_index + 1;
+  int n_missing = 0;
+
+  for (int i = 0; i < n_blocks; i++)
+  {
+    refs[i] = oufs_map_block(inode, first_index + i, map);
+    fresh[i] = 0;
+    if (refs[i] == UNALLOCATED_BLOCK)
+      n_missing++;
+  }
+  if (n_missing == 0)
+    return;
+
+  // Aim for the block right after the one before the range
+  BLOCK_REFERENCE goal = oufs_map_block(inode, first_index - 1, map);
+  if (goal != UNALLOCATED_BLOCK)
+    goal++;
+
+  int n_allocated = oufs_allocate_block_run(n_missing, goal, new_refs);
+
+  // Hand them out in order
+  int j = 0;
+  for (int i = 0; i < n_blocks && j < n_allocated; i++)
+  {
+    if (refs[i] != UNALLOCATED_BLOCK)
+      continue;
+    if (oufs_map_set(inode, first_index + i, new_refs[j], map) != 0)
+      break;
+    refs[i] = new_refs[j++];
+    fresh[i] = 1;
+  }
+
+  // Blocks that could not be attached (no room for an indirect block)
+  for (; j < n_allocated; j++)
+    oufs_deallocate_block(new_refs[j]);
+  oufs_map_flush(map);
+}
+
+/**
+ * Whether the contents of a file can stay in (or move into) its inode
+ * after a write
+ * @param inode inode of the file
+ * @param end offset just past the last byte written
+ * @return 1 if so, 0 if the file needs data blocks
+ */
+static int oufs_fits_inline(INODE *inode, int end)
+{
+  if (end > geometry.inline_size || oufs_inode_format() < OUFS_FORMAT_INLINE)
+    return 0;
+  return oufs_inline_data(inode) != NULL
+    || (inode->size == 0 && inode->data[0] == UNALLOCATED_BLOCK);
+}
+
+/**
+ * Move the contents of a file kept in its inode out to a data block
+ * @param fp file pointer
+ * @return 0 on success (or if there was nothing to move), -1 if the disk is full
+ */
+static int oufs_promote_inline(OUFILE *fp)
+{
+  unsigned char *payload = oufs_inline_data(&fp->inode);
+  if (payload == NULL)
+    return 0;
+
+  BLOCK block;
+  vdisk_fill_block(&block, 0, geometry.block_size);
+  memcpy(block.data.data, payload, fp->inode.size);
+
+  INODE saved = fp->inode;
+  for (int i = 0; i < BLOCKS_PER_INODE; i++)
+    fp->inode.data[i] = UNALLOCATED_BLOCK;
+
+  BLOCK_REFERENCE ref;
+  char fresh;
+  oufs_reserve_file_blocks(&fp->inode, &fp->map, 0, 0, &ref, &fresh);
+  if (ref == UNALLOCATED_BLOCK)
+  {
+    fp->inode = saved;
+    return -1;
+  }
+  vdisk_write_block(ref, &block);
+  fp->inode_dirty = 1;
+  return 0;
+}
+
+/**
+ * Copy bytes between a flat area and a list of buffers
+ * @param iov buffers
+ * @param iovcnt number of buffers
+ * @param skip number of bytes at the start of the buffers to pass over
+ * @param data flat area
+ * @param n number of bytes to copy
+ * @param to_iov 1 to copy from data into the buffers, 0 for the other way
+ */
+static void oufs_iov_copy(const struct iovec *iov, int iovcnt, int skip,
+                          unsigned char *data, int n, int to_iov)
+{
+  for (int i = 0; i < iovcnt && n > 0; i++)
+  {
+    int seg_len = iov[i].iov_len;
+    if (skip >= seg_len)
+    {
+      skip -= seg_len;
+      continue;
+    }
+
+    int span = MIN(seg_len - skip, n);
+    unsigned char *seg = (unsigned char *) iov[i].iov_base + skip;
+    if (to_iov)
+      memcpy(seg, data, span);
+    else
+      memcpy(data, seg, span);
+    data += span;
+    n -= span;
+    skip = 0;
+  }
+}
+
+/**
+ * Write len bytes, gathered from a list of buffers, at the file pointer's
+ * offset.  Up to OUFS_IO_BLOCKS blocks at a time are allocated up front,
+ * partly overwritten blocks are read, and then all of them are written with
+ * one multi-block write.
+ * @param fp file pointer
+ * @param iov buffers to write, in order
+ * @param iovcnt number of buffers
+ * @param len total number of bytes in the buffers (> 0, and fitting in a file)
+ * @return number of bytes written (less than len if the disk is full), -1 on error
+ */
+static int oufs_write_segments(OUFILE *fp, const struct iovec *iov, int iovcnt, int len)
+{
+  INODE *inode = &fp->inode;
+
+  // The write goes straight to the disk, which must not then be
+  //  overwritten by an older copy in the buffer
+  if (oufs_fflush(fp) != 0)
+    return -1;
+  fp->buffer_index = -1;
+
+  if (oufs_fits_inline(inode, fp->offset + len))
+  {
+    // Small file: the contents go in the inode
+    unsigned char *payload = oufs_inline_data(inode);
+    if (payload == NULL)
+    {
+      inode->data[0] = INLINE_DATA_MARKER;
+      payload = oufs_inline_data(inode);
+      memset(payload, 0, geometry.inline_size);
+    }
+    oufs_iov_copy(iov, iovcnt, 0, payload + fp->offset, len, 0);
+    fp->offset += len;
+    if (fp->offset > inode->size)
+      inode->size = fp->offset;
+    fp->inode_dirty = 1;
+    return len;
+  }
+
+  // The file is outgrowing its inode
+  if (oufs_promote_inline(fp) != 0)
+    return 0;
+
+  int bytes_written = 0;
+  while (bytes_written < len)
+  {
+    // Blocks covered by the next piece of the write
+    int head = fp->offset & (geometry.block_size - 1);
+    int n = MIN(len - bytes_written, (OUFS_IO_BLOCKS << geometry.block_shift) - head);
+    int first_index = fp->offset >> geometry.block_shift;
+    int last_index = (fp->offset + n - 1) >> geometry.block_shift;
+
+    // Allocate every block this piece will fill in one go (they are held
+    //  back to back in blocks)
+    BLOCK_REFERENCE refs[OUFS_IO_BLOCKS];
+    BLOCK blocks[OUFS_IO_BLOCKS];
+    char fresh[OUFS_IO_BLOCKS];
+    oufs_reserve_file_blocks(inode, &fp->map, first_index, last_index, refs, fresh);
+    int n_blocks = 0;
+    while (first_index + n_blocks <= last_index && refs[n_blocks] != UNALLOCATED_BLOCK)
+      n_blocks++;
+
+    // Disk full: write what fits
+    int full = (first_index + n_blocks <= last_index);
+    if (full)
+      n = (n_blocks << geometry.block_shift) - head;
+    if (n <= 0)
+      break;
+
+    // Blocks that are only partly overwritten keep the rest of their
+    //  contents (none, if they were holes)
+    int tail = (fp->offset + n) & (geometry.block_size - 1);
+    if (head != 0 || (n_blocks == 1 && tail != 0))
+    {
+      if (fresh[0])
+        vdisk_fill_block(blocks, 0, geometry.block_size);
+      else
+        vdisk_read_block(refs[0], blocks);
+    }
+    if (n_blocks > 1 && tail != 0)
     {
-      data_block_ref = inode.data[i];
-      if (data_block_ref != UNALLOCATED_BLOCK)
-      {
-        // Clear out block data
-        vdisk_read_block(data_block_ref, &data_block);
-        for (int j = 0; j < 256; j++)
-        {
-          data_block.data.data[j] = 0;
-        }
-        vdisk_write_block(data_block_ref, &data_block);
+      BLOCK *last = oufs_nth_block(blocks, n_blocks - 1);
+      if (fresh[n_blocks - 1])
+        vdisk_fill_block(last, 0, geometry.block_size);
+      else
+        vdisk_read_block(refs[n_blocks - 1], last);
+    }
 
-        // Deallocate block
-        oufs_deallocate_block(data_block_ref);
+    // The blocks sit back to back, so each buffer is one memcpy()
+    oufs_iov_copy(iov, iovcnt, bytes_written, blocks[0].data.data + head, n, 0);
 
-        inode.data[i] = UNALLOCATED_BLOCK;
-      }
-    }
-    oufs_write_inode_by_reference(child, &inode);
+    // Save the data blocks; the inode is saved by oufs_fflush()
+    vdisk_write_blocks(refs, n_blocks, blocks);
+    fp->offset += n;
+    bytes_written += n;
+    if (fp->offset > inode->size)
+      inode->size = fp->offset;
+    fp->inode_dirty = 1;
+
+    if (full)
+      break;
   }
 
-  OUFILE *fp = malloc(sizeof(OUFILE));
-  fp->inode_reference = child;
-  fp->mode = *mode;
+  return bytes_written;
+}
+
+/**
+ * Read len bytes at the file pointer's offset into a list of buffers.  The
+ * blocks involved are fetched with one multi-block read per OUFS_IO_BLOCKS
+ * blocks; holes read as zeros without touching the disk.
+ * @param fp file pointer
+ * @param iov buffers to fill, in order
+ * @param iovcnt number of buffers
+ * @param len total number of bytes to read (> 0, and inside the file)
+ * @return number of bytes read, -1 on error
+ */
+static int oufs_read_segments(OUFILE *fp, const struct iovec *iov, int iovcnt, int len)
+{
+  INODE *inode = &fp->inode;
+
+  // The disk must be up to date before reading around the buffer
+  if (oufs_fflush(fp) != 0)
+    return -1;
 
-  // Create file pointer struct and return it
-  if (*mode == 'r' || *mode == 'w')
+  unsigned char *payload = oufs_inline_data(inode);
+  if (payload != NULL)
   {
-    fp->offset = 0;
-    return fp;
+    // Small file: the contents are in the inode
+    oufs_iov_copy(iov, iovcnt, 0, payload + fp->offset, len, 1);
+    fp->offset += len;
+    return len;
   }
-  if (*mode == 'a')
+
+  int bytes_read = 0;
+  while (bytes_read < len)
   {
-    // Get offset from inode size field
-    INODE inode;
-    oufs_read_inode_by_reference(child, &inode);
-    fp->offset = inode.size;
-    return fp;
+    // Blocks covered by the next piece of the read, to be held back to
+    //  back in blocks
+    int head = fp->offset & (geometry.block_size - 1);
+    int n = MIN(len - bytes_read, (OUFS_IO_BLOCKS << geometry.block_shift) - head);
+    int first_index = fp->offset >> geometry.block_shift;
+    int last_index = (fp->offset + n - 1) >> geometry.block_shift;
+
+    BLOCK_REFERENCE refs[OUFS_IO_BLOCKS];
+    BLOCK blocks[OUFS_IO_BLOCKS];
+    int n_blocks = last_index - first_index + 1;
+    for (int i = 0; i < n_blocks; i++)
+      refs[i] = oufs_map_block(inode, first_index + i, &fp->map);
+
+    // Holes read as zeros; each run of real blocks is one multi-block read
+    for (int i = 0; i < n_blocks; )
+    {
+      int run = 1;
+      if (refs[i] == UNALLOCATED_BLOCK)
+        vdisk_fill_block(oufs_nth_block(blocks, i), 0, geometry.block_size);
+      else
+      {
+        while (i + run < n_blocks && refs[i + run] != UNALLOCATED_BLOCK)
+          run++;
+        if (vdisk_read_blocks(&refs[i], run, oufs_nth_block(blocks, i)) != 0)
+          return -1;
+      }
+      i += run;
+    }
+
+    // The blocks sit back to back, so each buffer is one memcpy()
+    oufs_iov_copy(iov, iovcnt, bytes_read, blocks[0].data.data + head, n, 1);
+    fp->offset += n;
+    bytes_read += n;
   }
-}
 
-void oufs_fclose(OUFILE *fp)
-{
-  free(fp);
+  return bytes_read;
 }
 
+/**
+ * Write len bytes at the file pointer's offset, growing the file as needed.
+ * The blocks involved are found directly from the offset and written back
+ * with multi-block writes.  Writes smaller than a block collect in the
+ * file pointer's buffer until oufs_fflush() or a write to another block.
+ * @param fp file pointer
+ * @param buf bytes to write
+ * @param len number of bytes to write
+ * @return number of bytes written (less than len if the file is full), -1 on error
+ */
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len)
 {
   if (fp->inode_reference == -1)
@@ -1055,122 +3390,218 @@ int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len)
     return -1;
   }
 
-  // Get file inode
-  INODE inode;
-  oufs_read_inode_by_reference(fp->inode_reference, &inode);
-
-  if (inode.type != IT_FILE)
+  INODE *inode = &fp->inode;
+  if (inode->type != IT_FILE)
   {
     if (debug)
       fprintf(stderr, "fwrite: must be file\n");
     return -1;
   }
 
-  // Declare some variables related to the data block
-  int block_index = 0;
-  int byte_index = 0;
-  BLOCK_REFERENCE data_block_ref;
-  BLOCK data_block;
-  int bytes_written = 0;
+  // Clip the write to the largest possible file
+  len = MIN(len, oufs_max_file_size() - fp->offset);
+  if (len <= 0)
+    return 0;
+
+  int index = fp->offset >> geometry.block_shift;
+  if (index == (fp->offset + len - 1) >> geometry.block_shift && len < geometry.block_size
+      && oufs_inline_data(inode) == NULL && !oufs_fits_inline(inode, fp->offset + len))
+  {
+    // Small write: collect it in the buffer
+    BLOCK_REFERENCE ref = fp->buffer_ref;
+    char fresh = 0;
+    if (fp->buffer_index != index)
+      oufs_reserve_file_blocks(inode, &fp->map, index, index, &ref, &fresh);
+    if (ref == UNALLOCATED_BLOCK)
+      return 0;
+    if (oufs_fill_buffer(fp, index, ref, fresh) != 0)
+      return -1;
+    memcpy(&fp->buffer.data.data[fp->offset & (geometry.block_size - 1)], buf, len);
+    fp->buffer_dirty = 1;
+    fp->offset += len;
+    if (fp->offset > inode->size)
+      inode->size = fp->offset;
+    fp->inode_dirty = 1;
+    return len;
+  }
 
+  struct iovec iov = { buf, len };
+  return oufs_write_segments(fp, &iov, 1, len);
+}
 
-  // Check if first data block is unallocated
-  if (inode.data[0] == UNALLOCATED_BLOCK)
+/**
+ * Read up to len bytes from the file pointer's offset and advance it.
+ * The blocks involved are found directly from the offset and fetched with
+ * multi-block reads.  Reads smaller than a block are served from the
+ * file pointer's buffer.
+ * @param fp file pointer
+ * @param buf where to put the bytes
+ * @param len maximum number of bytes to read
+ * @return number of bytes read (0 at end of file), -1 on error
+ */
+int oufs_fread(OUFILE *fp, unsigned char *buf, int len)
+{
+  if (fp->inode_reference == -1)
   {
-    // File is empty, so create a new data block
-    data_block_ref = oufs_allocate_new_block();
-    inode.data[0] = data_block_ref;
-    vdisk_read_block(data_block_ref, &data_block);  
+    fprintf(stderr, "fread: File pointer invalid\n");
+    return -1;
   }
-  else
+
+  INODE *inode = &fp->inode;
+  if (inode->type != IT_FILE)
   {
-    // Start at the first data block
-    data_block_ref = inode.data[0];
-    vdisk_read_block(data_block_ref, &data_block);  
+    if (debug)
+      fprintf(stderr, "fread: must be file\n");
+    return -1;
   }
 
-  // Move indices according to file offset
-  for (int i = 0; i < fp->offset; i++)
+  // Nothing past the end of the file
+  len = MIN(len, (int) inode->size - fp->offset);
+  if (len <= 0)
+    return 0;
+
+  int index = fp->offset >> geometry.block_shift;
+  if (index == (fp->offset + len - 1) >> geometry.block_shift && len < geometry.block_size
+      && oufs_inline_data(inode) == NULL)
   {
-    byte_index++;
+    // Small read: serve it from the buffer, or zeros for a hole
+    BLOCK_REFERENCE ref = fp->buffer_ref;
+    if (fp->buffer_index != index)
+      ref = oufs_map_block(inode, index, &fp->map);
+    if (ref == UNALLOCATED_BLOCK)
+      memset(buf, 0, len);
+    else if (oufs_fill_buffer(fp, index, ref, 0) != 0)
+      return -1;
+    else
+      memcpy(buf, &fp->buffer.data.data[fp->offset & (geometry.block_size - 1)], len);
+    fp->offset += len;
+    return len;
+  }
 
-    // If we have surpassed one data block, move on to the next
-    if (byte_index > 255)
-    {
-      byte_index = 0;
-      block_index++;
+  struct iovec iov = { buf, len };
+  return oufs_read_segments(fp, &iov, 1, len);
+}
 
-      // Check if we've ran out of space
-      if (block_index == BLOCKS_PER_INODE)
-      {
-        return 0;
-      }
+/**
+ * Total length of a list of buffers
+ * @return number of bytes, -1 if the list is invalid
+ */
+static int oufs_iov_length(const struct iovec *iov, int iovcnt)
+{
+  long total = 0;
 
-      // Create new data block if necessary
-      if (inode.data[block_index] == UNALLOCATED_BLOCK)
-      {
-        data_block_ref = oufs_allocate_new_block();
-        inode.data[block_index] = data_block_ref;
-        vdisk_read_block(data_block_ref, &data_block);  
-      }
-      else
-      {
-        data_block_ref = inode.data[block_index];
-        vdisk_read_block(data_block_ref, &data_block);  
-      }
-    }
+  if (iovcnt < 0)
+    return -1;
+  for (int i = 0; i < iovcnt; i++)
+  {
+    total += iov[i].iov_len;
+    if (total > INT_MAX)
+      return -1;
+  }
+  return total;
+}
+
+/**
+ * Write a list of buffers, one after the other, at the file pointer's
+ * offset.  The inode is looked at once and all blocks of all buffers go
+ * out in a single multi-block write.
+ * @param fp file pointer
+ * @param iov buffers to write, in order
+ * @param iovcnt number of buffers
+ * @return number of bytes written (less than the total if the file is full), -1 on error
+ */
+int oufs_fwritev(OUFILE *fp, const struct iovec *iov, int iovcnt)
+{
+  int len = oufs_iov_length(iov, iovcnt);
+  if (len < 0)
+    return -1;
+
+  if (fp->inode_reference == -1)
+  {
+    fprintf(stderr, "fwrite: File pointer invalid\n");
+    return -1;
   }
 
-  // Now that we have our correct index, start writing
-  for (int i = 0; i < len; i++)
+  if (fp->inode.type != IT_FILE)
   {
-    // Write the byte
-    data_block.data.data[byte_index] = buf[i];
-    inode.size++;
-    byte_index++;
-    bytes_written++;
+    if (debug)
+      fprintf(stderr, "fwrite: must be file\n");
+    return -1;
+  }
 
-    // If we have surpassed one data block, move on to the next
-    if (byte_index > 255 && i < len - 1)
+  // Clip the write to the largest possible file
+  len = MIN(len, oufs_max_file_size() - fp->offset);
+  if (len <= 0)
+    return 0;
+
+  if (fp->offset >> geometry.block_shift == (fp->offset + len - 1) >> geometry.block_shift
+      && len < geometry.block_size)
+  {
+    // Small write: every buffer lands in the same buffered block
+    int bytes_written = 0;
+    for (int i = 0; i < iovcnt && bytes_written < len; i++)
     {
-      // Write the old one
-      vdisk_write_block(data_block_ref, &data_block);
+      if (iov[i].iov_len == 0)
+        continue;
+      int ret = oufs_fwrite(fp, iov[i].iov_base, MIN((int) iov[i].iov_len, len - bytes_written));
+      if (ret <= 0)
+        return bytes_written > 0 ? bytes_written : ret;
+      bytes_written += ret;
+    }
+    return bytes_written;
+  }
 
-      byte_index = 0;
-      block_index++;
+  return oufs_write_segments(fp, iov, iovcnt, len);
+}
 
-      // Check if we've ran out of space
-      if (block_index == BLOCKS_PER_INODE)
-      {
-        break;
-      }
+/**
+ * Read from the file pointer's offset into a list of buffers, filling each
+ * before moving on to the next.  All blocks involved come in with a single
+ * multi-block read.
+ * @param fp file pointer
+ * @param iov buffers to fill, in order
+ * @param iovcnt number of buffers
+ * @return number of bytes read (0 at end of file), -1 on error
+ */
+int oufs_freadv(OUFILE *fp, const struct iovec *iov, int iovcnt)
+{
+  int len = oufs_iov_length(iov, iovcnt);
+  if (len < 0)
+    return -1;
 
-      // Create new data block if necessary
-      if (inode.data[block_index] == UNALLOCATED_BLOCK)
-      {
-        data_block_ref = oufs_allocate_new_block();
-        inode.data[block_index] = data_block_ref;
-        vdisk_read_block(data_block_ref, &data_block);  
-      }
-      else
-      {
-        data_block_ref = inode.data[block_index];
-        vdisk_read_block(data_block_ref, &data_block);  
-      }
-    }
+  if (fp->inode_reference == -1)
+  {
+    fprintf(stderr, "fread: File pointer invalid\n");
+    return -1;
   }
 
-  // Done writing, save the current data block and inode
-  vdisk_write_block(data_block_ref, &data_block);
-  oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  if (fp->inode.type != IT_FILE)
+  {
+    if (debug)
+      fprintf(stderr, "fread: must be file\n");
+    return -1;
+  }
 
-  // Update file pointer offset
-  fp->offset += bytes_written;
+  // Nothing past the end of the file
+  len = MIN(len, (int) fp->inode.size - fp->offset);
+  if (len <= 0)
+    return 0;
 
-  return bytes_written;
+  return oufs_read_segments(fp, iov, iovcnt, len);
 }
 
-int oufs_fread(OUFILE *fp, unsigned char *buf, int len)
+/**
+ * Read up to len bytes from the file pointer's offset without copying them
+ * out: each block is brought into the file pointer's buffer and handed to
+ * the callback in place.  The offset advances past every byte the callback
+ * is given.
+ * @param fp file pointer
+ * @param len maximum number of bytes to read
+ * @param callback called once per block (or part of a block)
+ * @param arg passed through to the callback
+ * @return number of bytes handed to the callback, -1 on error
+ */
+int oufs_fread_blocks(OUFILE *fp, int len, OUFS_BLOCK_CALLBACK callback, void *arg)
 {
   if (fp->inode_reference == -1)
   {
@@ -1178,104 +3609,239 @@ int oufs_fread(OUFILE *fp, unsigned char *buf, int len)
     return -1;
   }
 
-  // Get file inode
-  INODE inode;
-  oufs_read_inode_by_reference(fp->inode_reference, &inode);
-
-  if (inode.type != IT_FILE)
+  INODE *inode = &fp->inode;
+  if (inode->type != IT_FILE)
   {
     if (debug)
       fprintf(stderr, "fread: must be file\n");
     return -1;
   }
 
-  // Declare some variables related to the data block
-  BLOCK_REFERENCE data_block_ref;
-  BLOCK data_block;
-  int block_index = 0;
-  int byte_index = 0;
-  int bytes_read = 0;
-  char new_buf[len];
-  memset(new_buf, '\0', len);
+  // Nothing past the end of the file
+  len = MIN(len, (int) inode->size - fp->offset);
 
-  // Check if first data block is unallocated
-  if (inode.data[0] == UNALLOCATED_BLOCK)
+  unsigned char *payload = oufs_inline_data(inode);
+  if (payload != NULL)
   {
-    // We can't read from an empty file
-    return 0;
+    // Small file: the contents are in the inode
+    if (len <= 0)
+      return 0;
+    fp->offset += len;
+    callback(payload + fp->offset - len, len, arg);
+    return len;
   }
-  else
+
+  int bytes_read = 0;
+  while (bytes_read < len)
   {
-    // Start at the first data block
-    data_block_ref = inode.data[0];
-    vdisk_read_block(data_block_ref, &data_block);  
+    // Holes are handed over as a block of zeros
+    static const unsigned char zero_block[VDISK_MAX_BLOCK_SIZE];
+    const unsigned char *data = zero_block;
+
+    int index = fp->offset >> geometry.block_shift;
+    BLOCK_REFERENCE ref = fp->buffer_ref;
+    if (fp->buffer_index != index)
+      ref = oufs_map_block(inode, index, &fp->map);
+    if (ref != UNALLOCATED_BLOCK)
+    {
+      if (oufs_fill_buffer(fp, index, ref, 0) != 0)
+        return -1;
+      data = fp->buffer.data.data;
+    }
+
+    int byte_index = fp->offset & (geometry.block_size - 1);
+    int span = MIN(geometry.block_size - byte_index, len - bytes_read);
+    fp->offset += span;
+    bytes_read += span;
+    if (callback(data + byte_index, span, arg) != 0)
+      break;
   }
 
-  // Move indices according to file offset
-  for (int i = 0; i < fp->offset; i++)
+  return bytes_read;
+}
+
+/**
+ * Move the file pointer's offset.  The offset may go past the end of the
+ * file; a later write there leaves a hole, which reads as zeros.
+ * @param fp file pointer
+ * @param offset new offset, relative to whence
+ * @param whence SEEK_SET, SEEK_CUR or SEEK_END
+ * @return 0 on success, -1 on error
+ */
+int oufs_fseek(OUFILE *fp, int offset, int whence)
+{
+  if (fp->inode_reference == -1)
   {
-    byte_index++;
+    fprintf(stderr, "fseek: File pointer invalid\n");
+    return -1;
+  }
 
-    // If we have surpassed one data block, move on to the next
-    if (byte_index > 255)
-    {
-      byte_index = 0;
-      block_index++;
+  int base;
+  if (whence == SEEK_SET)
+    base = 0;
+  else if (whence == SEEK_CUR)
+    base = fp->offset;
+  else if (whence == SEEK_END)
+    base = fp->inode.size;
+  else
+    return -1;
 
-      // Check if we've ran out of space
-      if (block_index == BLOCKS_PER_INODE)
-      {
-        return 0;
-      }
+  if (base + offset < 0)
+    return -1;
+  fp->offset = base + offset;
+  return 0;
+}
 
-      if (inode.data[block_index] == UNALLOCATED_BLOCK)
-      {
-        // Offset exceeds file length, return 0
-        return 0;
-      }
-      else
-      {
-        data_block_ref = inode.data[block_index];
-        vdisk_read_block(data_block_ref, &data_block);  
-      }
-    }
+/**
+ * @param fp file pointer
+ * @return the file pointer's offset, -1 on error
+ */
+int oufs_ftell(OUFILE *fp)
+{
+  if (fp->inode_reference == -1)
+    return -1;
+  return fp->offset;
+}
+
+/**
+ * Read up to len bytes at the given offset, leaving the file pointer's own
+ * offset where it was.  Only the blocks of the range are touched.
+ * @param fp file pointer
+ * @param buf where to put the bytes
+ * @param len maximum number of bytes to read
+ * @param offset where to start reading
+ * @return number of bytes read (0 at end of file), -1 on error
+ */
+int oufs_pread(OUFILE *fp, unsigned char *buf, int len, int offset)
+{
+  if (offset < 0)
+    return -1;
+
+  int saved_offset = fp->offset;
+  fp->offset = offset;
+  int ret = oufs_fread(fp, buf, len);
+  fp->offset = saved_offset;
+  return ret;
+}
+
+/**
+ * Write len bytes at the given offset, leaving the file pointer's own
+ * offset where it was.  Only the blocks of the range are touched.
+ * @param fp file pointer
+ * @param buf bytes to write
+ * @param len number of bytes to write
+ * @param offset where to start writing
+ * @return number of bytes written (less than len if the file is full), -1 on error
+ */
+int oufs_pwrite(OUFILE *fp, unsigned char *buf, int len, int offset)
+{
+  if (offset < 0)
+    return -1;
+
+  int saved_offset = fp->offset;
+  fp->offset = offset;
+  int ret = oufs_fwrite(fp, buf, len);
+  fp->offset = saved_offset;
+  return ret;
+}
+
+/**
+ * Zero part of one block of a file, unless it is a hole already
+ * @param fp file pointer (its buffer must not hold the block)
+ * @param index block index in the file
+ * @param from first byte to zero
+ * @param to byte after the last one to zero
+ * @return 0 on success, -1 on error
+ */
+static int oufs_zero_block_part(OUFILE *fp, int index, int from, int to)
+{
+  BLOCK block;
+  BLOCK_REFERENCE ref = oufs_map_block(&fp->inode, index, &fp->map);
+  if (ref == UNALLOCATED_BLOCK)
+    return 0;
+
+  if (vdisk_read_block(ref, &block) != 0)
+    return -1;
+  memset(&block.data.data[from], 0, to - from);
+  return vdisk_write_block(ref, &block);
+}
+
+/**
+ * Free the blocks of a file in a byte range, leaving a hole that reads as
+ * zeros.  Blocks only partly inside the range are kept, with that part
+ * zeroed.  The size of the file does not change.
+ * @param fp file pointer
+ * @param offset first byte of the range
+ * @param len number of bytes in the range
+ * @return 0 on success, -1 on error
+ */
+int oufs_punch_hole(OUFILE *fp, int offset, int len)
+{
+  if (fp->inode_reference == -1)
+  {
+    fprintf(stderr, "punch_hole: File pointer invalid\n");
+    return -1;
   }
 
-  // Now read bytes into buffer
-  for (int i = 0; i < len; i++)
+  INODE *inode = &fp->inode;
+  if (inode->type != IT_FILE || offset < 0 || len < 0)
+    return -1;
+
+  // Nothing past the end of the file
+  len = MIN(len, (int) inode->size - offset);
+  if (len <= 0)
+    return 0;
+  int end = offset + len;
+
+  unsigned char *payload = oufs_inline_data(inode);
+  if (payload != NULL)
   {
-    // Read the byte
-    new_buf[i] = data_block.data.data[byte_index];
-    bytes_read++;
-    byte_index++;
+    // Small file: the contents are in the inode
+    memset(payload + offset, 0, len);
+    fp->inode_dirty = 1;
+    return 0;
+  }
 
-    // If we have surpassed one data block, move on to the next
-    if (byte_index > 255 && i < len - 1)
-    {
-      byte_index = 0;
-      block_index++;
+  // The buffer may hold a block in the range
+  if (oufs_fflush(fp) != 0)
+    return -1;
+  fp->buffer_index = -1;
+
+  // Blocks at the edges of the range
+  int block_size = geometry.block_size;
+  int head_index = offset / block_size;
+  int tail_index = end / block_size;
+  if (offset % block_size != 0
+      && oufs_zero_block_part(fp, head_index, offset % block_size,
+                              head_index == tail_index ? end % block_size : block_size) != 0)
+    return -1;
+  if (end % block_size != 0 && (head_index != tail_index || offset % block_size == 0)
+      && oufs_zero_block_part(fp, tail_index, 0, end % block_size) != 0)
+    return -1;
 
-      // Check if we've ran out of space
-      if (block_index == BLOCKS_PER_INODE)
-      {
-        return 0;
-      }
+  // Blocks entirely inside the range
+  int first_index = (offset + block_size - 1) / block_size;
+  int last_index = end / block_size - 1;
+  if (first_index > last_index)
+    return 0;
 
-      if (inode.data[block_index] == UNALLOCATED_BLOCK)
-      {
-        // Offset exceeds file length, return 0
-        return 0;
-      }
-      else
-      {
-        data_block_ref = inode.data[block_index];
-        vdisk_read_block(data_block_ref, &data_block);  
-      }
-    }
+  OUFS_RELEASE_BATCH batch;
+  batch.n_refs = 0;
+  for (int index = first_index; index <= last_index; index++)
+  {
+    BLOCK_REFERENCE ref = oufs_map_block(inode, index, &fp->map);
+    if (ref == UNALLOCATED_BLOCK)
+      continue;
+    oufs_map_set(inode, index, UNALLOCATED_BLOCK, &fp->map);
+    oufs_release_add(&batch, ref);
   }
+  oufs_prune_indirect(inode, &fp->map, first_index, last_index, &batch);
+  if (oufs_map_flush(&fp->map) != 0)
+    return -1;
+  oufs_release_batch(&batch);
 
-  strncpy(buf, new_buf, len);
-  return bytes_read;
+  fp->inode_dirty = 1;
+  return 0;
 }
 
 int oufs_remove(char *cwd, char *path)
@@ -1285,8 +3851,6 @@ int oufs_remove(char *cwd, char *path)
   INODE_REFERENCE child;
   char local_name[FILE_NAME_SIZE];
 
-  char* base = basename(strdup(path));
-
   // Try to find the file
   int exists = oufs_find_file(cwd, path, &parent, &child, local_name);
 
@@ -1305,34 +3869,7 @@ int oufs_remove(char *cwd, char *path)
 
 
     // Remove reference from parent
-    // Read data for parent of deleted directory
-    INODE parent_inode;
-    oufs_read_inode_by_reference(parent, &parent_inode);
-    BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
-    BLOCK parent_block;
-    vdisk_read_block(parent_block_ref, &parent_block);
-
-    // Remove the directory's entry from its parent directory
-    int removed_entry = 0;
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
-    {
-      // Does the directory entry point to the one we're deleting?
-      if (!strcmp(parent_block.directory.entry[i].name, base))
-      {
-        // Set the empty entry to point to our new inode
-        strncpy(parent_block.directory.entry[i].name, "", FILE_NAME_SIZE);
-        parent_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-        removed_entry = 1;
-        vdisk_write_block(parent_block_ref, &parent_block);
-
-        // Update file count in inode
-        parent_inode.size--;
-        oufs_write_inode_by_reference(parent, &parent_inode);
-
-        // Exit the for loop
-        break;
-      }
-    }
+    oufs_remove_entry(parent, local_name, child);
 
     // Decrease reference count
     inode.n_references--;
@@ -1340,31 +3877,8 @@ int oufs_remove(char *cwd, char *path)
     // If there are no more references, clear up the data
     if (inode.n_references == 0)
     {
-      // Block variables used for deleting
-      BLOCK_REFERENCE data_block_ref;
-      BLOCK data_block;
-
-      // clear data block by block
-      inode.size = 0;
-      for (int i = 0; i < BLOCKS_PER_INODE; i++)
-      {
-        data_block_ref = inode.data[i];
-        if (data_block_ref != UNALLOCATED_BLOCK)
-        {
-          // Clear out block data
-          vdisk_read_block(data_block_ref, &data_block);
-          for (int j = 0; j < 256; j++)
-          {
-            data_block.data.data[j] = 0;
-          }
-          vdisk_write_block(data_block_ref, &data_block);
-
-          // Deallocate block
-          oufs_deallocate_block(data_block_ref);
-
-          inode.data[i] = UNALLOCATED_BLOCK;
-        }
-      }
+      // clear and free the data blocks
+      oufs_release_file_blocks(&inode);
       oufs_deallocate_inode(child);
     }
     oufs_write_inode_by_reference(child, &inode);
@@ -1376,34 +3890,27 @@ int oufs_remove(char *cwd, char *path)
       fprintf(stderr, "remove: file does not exist\n");
     return -1;
   }
+
+  return 0;
 }
 
 int oufs_link(char *cwd, char *path_src, char *path_dst)
 {
-  // Get dest directory name
-  char* dst_dir = dirname(strdup(path_dst));
-  char* dst_base = basename(strdup(path_dst));
-
   // Declare find file outputs
   INODE_REFERENCE parent_src;
   INODE_REFERENCE child_src;
   char local_name_src[FILE_NAME_SIZE];
-  INODE_REFERENCE grandparent_dst;
-  INODE_REFERENCE parent_dst;
-  INODE_REFERENCE child_dst;
-  char local_name_dst[FILE_NAME_SIZE];
-  char local_name_dst_dir[FILE_NAME_SIZE];
+  OUFS_LOOKUP dst;
 
-  // Try to find the files
+  // Try to find the source, and the destination's directory
   int src_exists = oufs_find_file(cwd, path_src, &parent_src, &child_src, local_name_src);
-  int dst_exists = oufs_find_file(cwd, path_dst, &parent_dst, &child_dst, local_name_dst);
-  int dst_dir_exists = oufs_find_file(cwd, dst_dir, &grandparent_dst, &parent_dst, local_name_dst_dir);
+  int dst_dir_exists = oufs_lookup_parent(cwd, path_dst, &dst);
 
   // Make sure that
   // (1) source exists
   // (2) destination does not yet exist
   // (3) destination parent directory does exist
-  if (src_exists && !dst_exists && dst_dir_exists)
+  if (src_exists && dst_dir_exists && dst.entry < 0)
   {
     // Get inode for file to delete
     INODE inode;
@@ -1416,44 +3923,26 @@ int oufs_link(char *cwd, char *path_src, char *path_dst)
       return -1;
     }
 
-    // Get inode for parent directory
-    INODE parent_inode;
-    oufs_read_inode_by_reference(parent_dst, &parent_inode);
-    BLOCK dblock;
-    vdisk_read_block(parent_inode.data[0], &dblock);
-
-    // Iterate through directory entries looking for a blank one
-    int found_entry = 0;
-    DIRECTORY_ENTRY entry;
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    // The reference count must not wrap around
+    if (inode.n_references == UCHAR_MAX)
     {
-      if (dblock.directory.entry[i].inode_reference == UNALLOCATED_INODE)
-      {
-        // Found an empty one
-        found_entry = 1;
-
-        // Link it
-        memset(dblock.directory.entry[i].name, 0, FILE_NAME_SIZE);
-        strncpy(dblock.directory.entry[i].name, dst_base, FILE_NAME_SIZE-1);
-        dblock.directory.entry[i].inode_reference = child_src;
-
-        // Write changes to block
-        vdisk_write_block(parent_inode.data[0], &dblock);
-        break;
-      }
+      if (debug)
+        fprintf(stderr, "link: too many links\n");
+      return -1;
     }
 
-    if (!found_entry)
+    if (oufs_make_room(&dst) != 0)
     {
       if (debug)
         fprintf(stderr, "link: destination directory is full\n");
       return -1;
     }
 
+    // Link it
+    oufs_add_entry(&dst, child_src);
+
     // update inodes
-    parent_inode.size++;
     inode.n_references++;
-    oufs_write_inode_by_reference(parent_dst, &parent_inode);
     oufs_write_inode_by_reference(child_src, &inode);
   }
   else
@@ -1,22 +1,568 @@
+#include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include "vdisk.h"
 /*
  * Virtual disk implementation.
  *
  * The disk is implemented on top of a file.  Access provided by this
  * library is on a block-by-block basis
+ *
+ * Blocks pass through a small write-back cache.  Reads of a cached block
+ * never touch the file, and writes only mark the cached copy dirty; dirty
+ * blocks reach the file when they are evicted (least recently used first),
+ * on vdisk_flush() and on vdisk_disk_close().
+ *
+ * Alternatively the whole image can be mapped into memory (the "mmap"
+ * disk option or the ZDISK_MMAP environment variable).  Block I/O is then
+ * a memcpy() against the mapping, there is no block cache, and the mapping
+ * is msync()ed on vdisk_flush() and vdisk_disk_close().
+ *
+ * The number of blocks and their size come from the superblock at the end
+ * of block 0 (see vdisk_set_geometry()); a disk without one has
+ * N_BLOCKS_IN_DISK blocks of VDISK_MIN_BLOCK_SIZE bytes.  Blocks are
+ * copied with vdisk_copy_block(), which has a fixed-size copy for each
+ * usual block size.
  */
 
 // Debug flag
 #define debug 0
 
+// Marks the end of the LRU list and empty slots in the block map
+#define NO_SLOT (-1)
+
+// Longest run of adjacent blocks moved by a single preadv()/pwritev()
+#ifdef IOV_MAX
+#define VDISK_MAX_RUN IOV_MAX
+#else
+#define VDISK_MAX_RUN 1024
+#endif
+
 // File descriptor for virtual disk.  Private to this file
 // Yes, global variables are generally a bad idea...
 
 int vdisk_fd = 0;
 
+// One cached block
+typedef struct cache_slot_s
+{
+  // Block held by this slot; only meaningful if valid
+  BLOCK_REFERENCE block_ref;
+  int valid;
+
+  // Cached copy differs from the file
+  int dirty;
+
+  // Neighbours in the LRU list (slot indices)
+  int newer;
+  int older;
+
+  // One block of cache_data
+  unsigned char *data;
+} CACHE_SLOT;
+
+// Requested cache size (0 = no caching); negative = not set yet
+static int cache_size_requested = -1;
+
+// Cache state.  Only valid while the disk is open
+static CACHE_SLOT *cache_slots = NULL;
+static unsigned char *cache_data = NULL;
+static int cache_size = 0;
+
+// Block reference -> slot index (NO_SLOT if not cached)
+static int *cache_map = NULL;
+
+// Most and least recently used slots
+static int cache_newest = NO_SLOT;
+static int cache_oldest = NO_SLOT;
+
+static VDISK_STATS vdisk_stats;
+
+// Requested backend: 1 = mmap, 0 = file descriptor; negative = not set yet
+static int mmap_requested = -1;
+
+// Mapping of the whole image in mmap mode; NULL for the fd backend
+static unsigned char *vdisk_map = NULL;
+
+// Called by vdisk_disk_close() before anything is flushed
+static int (*vdisk_close_hook)() = NULL;
+
+// Geometry of the open disk: number of blocks, and bytes per block
+//  (1 << vdisk_block_shift)
+static VDISK_SUPERBLOCK vdisk_superblock;
+static int vdisk_blocks = 0;
+static int vdisk_block_bytes = 0;
+static int vdisk_block_shift = 0;
+
+// Geometry for the next vdisk_disk_open() to create; 0 blocks = none
+static int requested_blocks = 0;
+static int requested_inode_blocks = 0;
+static int requested_block_size = 0;
+
+/**
+ * Read a run of adjacent blocks directly from the file with one preadv()
+ *
+ * @param first_ref First block of the run
+ * @param iov One buffer of vdisk_block_bytes bytes per block
+ * @param n Number of blocks in the run (at most VDISK_MAX_RUN)
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_host_readv(BLOCK_REFERENCE first_ref, struct iovec *iov, int n)
+{
+  ssize_t len = (ssize_t) n << vdisk_block_shift;
+
+  ++vdisk_stats.host_calls;
+  if(preadv(vdisk_fd, iov, n, (off_t) first_ref << vdisk_block_shift) != len) {
+    fprintf(stderr, "vdisk_read_block(): read failed\n");
+    return(-4);
+  }
+
+  vdisk_stats.host_reads += n;
+  return(0);
+}
+
+/**
+ * Write a run of adjacent blocks directly to the file with one pwritev()
+ *
+ * @param first_ref First block of the run
+ * @param iov One buffer of vdisk_block_bytes bytes per block
+ * @param n Number of blocks in the run (at most VDISK_MAX_RUN)
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_host_writev(BLOCK_REFERENCE first_ref, struct iovec *iov, int n)
+{
+  ssize_t len = (ssize_t) n << vdisk_block_shift;
+
+  ++vdisk_stats.host_calls;
+  if(pwritev(vdisk_fd, iov, n, (off_t) first_ref << vdisk_block_shift) != len) {
+    fprintf(stderr, "vdisk_write_block(): write failed\n");
+    return(-4);
+  }
+
+  vdisk_stats.host_writes += n;
+  return(0);
+}
+
+/**
+ * Read one block directly from the file
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_host_read(BLOCK_REFERENCE block_ref, void *block)
+{
+  ++vdisk_stats.host_calls;
+  if(pread(vdisk_fd, block, vdisk_block_bytes, (off_t) block_ref << vdisk_block_shift)
+     != vdisk_block_bytes) {
+    fprintf(stderr, "vdisk_read_block(): read failed\n");
+    return(-4);
+  }
+
+  ++vdisk_stats.host_reads;
+  return(0);
+}
+
+/**
+ * Write one block directly to the file
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_host_write(BLOCK_REFERENCE block_ref, void *block)
+{
+  ++vdisk_stats.host_calls;
+  if(pwrite(vdisk_fd, block, vdisk_block_bytes, (off_t) block_ref << vdisk_block_shift)
+     != vdisk_block_bytes) {
+    fprintf(stderr, "vdisk_write_block(): write failed\n");
+    return(-4);
+  }
+
+  ++vdisk_stats.host_writes;
+  return(0);
+}
+
+/**
+ * Remove a slot from the LRU list
+ */
+static void cache_unlink(int slot)
+{
+  CACHE_SLOT *s = &cache_slots[slot];
+
+  if(s->newer != NO_SLOT)
+    cache_slots[s->newer].older = s->older;
+  else
+    cache_newest = s->older;
+
+  if(s->older != NO_SLOT)
+    cache_slots[s->older].newer = s->newer;
+  else
+    cache_oldest = s->newer;
+}
+
+/**
+ * Insert a slot at the most recently used end of the LRU list
+ */
+static void cache_push_newest(int slot)
+{
+  CACHE_SLOT *s = &cache_slots[slot];
+
+  s->newer = NO_SLOT;
+  s->older = cache_newest;
+  if(cache_newest != NO_SLOT)
+    cache_slots[cache_newest].newer = slot;
+  cache_newest = slot;
+  if(cache_oldest == NO_SLOT)
+    cache_oldest = slot;
+}
+
+/**
+ * Claim a slot for block_ref, evicting the least recently used block
+ * (and writing it back if it is dirty).  The new slot is the most
+ * recently used one, is valid and is clean; its data is undefined.
+ *
+ * @return the slot index; <0 on error
+ */
+static int cache_claim(BLOCK_REFERENCE block_ref)
+{
+  int slot = cache_oldest;
+  CACHE_SLOT *s = &cache_slots[slot];
+
+  if(s->valid) {
+    if(s->dirty) {
+      int ret = vdisk_host_write(s->block_ref, s->data);
+      if(ret != 0)
+        return(ret);
+      ++vdisk_stats.evictions;
+    }
+    cache_map[s->block_ref] = NO_SLOT;
+  }
+
+  if(debug)
+    fprintf(stderr, "##Cache slot %d: block %d\n", slot, block_ref);
+
+  s->block_ref = block_ref;
+  s->valid = 1;
+  s->dirty = 0;
+  cache_map[block_ref] = slot;
+
+  cache_unlink(slot);
+  cache_push_newest(slot);
+  return(slot);
+}
+
+/**
+ * Mark a cached block as the most recently used one
+ */
+static void cache_touch(int slot)
+{
+  if(cache_newest != slot) {
+    cache_unlink(slot);
+    cache_push_newest(slot);
+  }
+}
+
+/**
+ * Set up an empty cache according to the requested size.  The size comes
+ * from vdisk_set_cache_size() if it was called, otherwise from the
+ * ZDISK_CACHE environment variable, otherwise VDISK_DEFAULT_CACHE_BLOCKS.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int cache_init()
+{
+  int n = cache_size_requested;
+  if(n < 0) {
+    char *str = getenv("ZDISK_CACHE");
+    n = (str == NULL) ? VDISK_DEFAULT_CACHE_BLOCKS : atoi(str);
+    if(n < 0)
+      n = 0;
+  }
+  if(n > vdisk_blocks)
+    n = vdisk_blocks;
+
+  for(int i = 0; i < vdisk_blocks; ++i)
+    cache_map[i] = NO_SLOT;
+  cache_newest = NO_SLOT;
+  cache_oldest = NO_SLOT;
+  cache_size = 0;
+  cache_slots = NULL;
+  cache_data = NULL;
+
+  if(n == 0)
+    return(0);
+
+  // The blocks themselves are packed, so that a small block size makes a
+  //  small cache
+  cache_slots = malloc(n * sizeof(CACHE_SLOT));
+  cache_data = malloc((size_t) n << vdisk_block_shift);
+  if(cache_slots == NULL || cache_data == NULL) {
+    fprintf(stderr, "vdisk_disk_open(): cannot allocate block cache\n");
+    free(cache_slots);
+    free(cache_data);
+    cache_slots = NULL;
+    cache_data = NULL;
+    return(-1);
+  }
+
+  cache_size = n;
+  for(int i = 0; i < n; ++i) {
+    cache_slots[i].data = cache_data + ((size_t) i << vdisk_block_shift);
+    cache_slots[i].valid = 0;
+    cache_slots[i].dirty = 0;
+    cache_push_newest(i);
+  }
+  return(0);
+}
+
+/**
+ * Set the number of blocks held by the block cache.  Takes effect on the
+ * next vdisk_disk_open().  0 turns the cache off.
+ *
+ * @param n_blocks Number of blocks to cache
+ * @return 0 on success; <0 on error
+ */
+int vdisk_set_cache_size(int n_blocks)
+{
+  if(n_blocks < 0) {
+    fprintf(stderr, "vdisk_set_cache_size(): bad size (%d)\n", n_blocks);
+    return(-1);
+  }
+  cache_size_requested = n_blocks;
+  return(0);
+}
+
+/**
+ * Select the backend used by the next vdisk_disk_open().
+ *
+ * @param on 1 to map the image into memory; 0 for plain file I/O
+ * @return 0 on success
+ */
+int vdisk_set_mmap(int on)
+{
+  mmap_requested = (on != 0);
+  return(0);
+}
+
+/**
+ * Map the whole image into memory, growing the file to full size first
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_map_image(int fd)
+{
+  off_t size = (off_t) vdisk_blocks << vdisk_block_shift;
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || (st.st_size < size && ftruncate(fd, size) != 0)) {
+    fprintf(stderr, "vdisk_disk_open(): cannot size image for mapping\n");
+    return(-1);
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED) {
+    fprintf(stderr, "vdisk_disk_open(): mmap failed\n");
+    return(-1);
+  }
+
+  vdisk_map = map;
+  return(0);
+}
+
+/**
+ * Write every dirty cached block back to the file.  Dirty blocks with
+ * adjacent block numbers go out together in one pwritev().
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_flush()
+{
+  struct iovec iov[VDISK_MAX_RUN];
+  int run_slots[VDISK_MAX_RUN];
+  int n = 0;
+  BLOCK_REFERENCE first_ref = 0;
+
+  if(vdisk_map != NULL) {
+    if(msync(vdisk_map, (size_t) vdisk_blocks << vdisk_block_shift, MS_SYNC) != 0) {
+      fprintf(stderr, "vdisk_flush(): msync failed\n");
+      return(-4);
+    }
+    return(0);
+  }
+
+  if(cache_size == 0)
+    return(0);
+
+  // Walk the disk in block order so that neighbours end up in the same run
+  for(int b = 0; b <= vdisk_blocks; ++b) {
+    int slot = (b < vdisk_blocks) ? cache_map[b] : NO_SLOT;
+    int dirty = (slot != NO_SLOT && cache_slots[slot].dirty);
+
+    // Emit the pending run when it cannot be extended
+    if(n > 0 && (!dirty || n == VDISK_MAX_RUN)) {
+      int ret = vdisk_host_writev(first_ref, iov, n);
+      if(ret != 0)
+        return(ret);
+      for(int i = 0; i < n; ++i)
+        cache_slots[run_slots[i]].dirty = 0;
+      n = 0;
+    }
+
+    if(dirty) {
+      if(n == 0)
+        first_ref = b;
+      iov[n].iov_base = cache_slots[slot].data;
+      iov[n].iov_len = vdisk_block_bytes;
+      run_slots[n] = slot;
+      ++n;
+    }
+  }
+  return(0);
+}
+
+/**
+ * Register a function that vdisk_disk_close() calls while the disk is
+ * still open, so that layers above can write back what they hold in
+ * memory.  The hook is cleared once it has run.
+ *
+ * @param hook Function to call; NULL to clear
+ */
+void vdisk_set_close_hook(int (*hook)())
+{
+  vdisk_close_hook = hook;
+}
+
+/**
+ * Copy out the cache counters for the current session
+ *
+ * @param stats Structure to fill in
+ */
+void vdisk_get_stats(VDISK_STATS *stats)
+{
+  *stats = vdisk_stats;
+}
+
+/**
+ * Make the next vdisk_disk_open() create a new, empty disk with the given
+ * geometry (recorded in its superblock) instead of opening the existing one
+ *
+ * @param n_blocks Number of blocks on the disk
+ * @param n_inode_blocks Number of inode blocks, for the file system
+ * @param block_size Bytes per block (see VDISK_BLOCK_SIZE_OK())
+ * @return 0 on success; <0 if the geometry is not possible
+ */
+int vdisk_set_geometry(int n_blocks, int n_inode_blocks, int block_size)
+{
+  if(n_blocks < 2 || n_blocks > VDISK_MAX_BLOCKS || n_inode_blocks < 0) {
+    fprintf(stderr, "vdisk_set_geometry(): bad geometry (%d blocks)\n", n_blocks);
+    return(-1);
+  }
+  if(!VDISK_BLOCK_SIZE_OK(block_size)) {
+    fprintf(stderr, "vdisk_set_geometry(): bad block size (%d)\n", block_size);
+    return(-1);
+  }
+  requested_blocks = n_blocks;
+  requested_inode_blocks = n_inode_blocks;
+  requested_block_size = block_size;
+  return(0);
+}
+
+/**
+ * Copy out the superblock of the open disk (a disk without one reports
+ * the default geometry, with a zero magic number)
+ *
+ * @param superblock Structure to fill in
+ */
+void vdisk_get_superblock(VDISK_SUPERBLOCK *superblock)
+{
+  *superblock = vdisk_superblock;
+}
+
+/**
+ * @return the number of blocks on the open disk
+ */
+int vdisk_n_blocks()
+{
+  return(vdisk_blocks);
+}
+
+/**
+ * @return the number of bytes in a block of the open disk
+ */
+int vdisk_block_size()
+{
+  return(vdisk_block_bytes);
+}
+
+/**
+ * Find the geometry of an existing disk.  The superblock is looked for at
+ * the end of block 0 for every block size a disk may have been made with,
+ * so that a disk with blocks larger than VDISK_MAX_BLOCK_SIZE is refused
+ * rather than misread.
+ *
+ * @return 0 on success; <0 if the disk cannot be used by this build
+ */
+static int vdisk_read_superblock(int fd)
+{
+  VDISK_SUPERBLOCK sb;
+
+  for(long size = VDISK_MIN_BLOCK_SIZE; size <= 65536; size *= 2) {
+    if(pread(fd, &sb, sizeof(sb), VDISK_SUPERBLOCK_OFFSET(size)) != sizeof(sb)
+       || sb.magic != VDISK_MAGIC || sb.block_size != size)
+      continue;
+
+    if(!VDISK_BLOCK_SIZE_OK(sb.block_size)) {
+      fprintf(stderr, "vdisk_disk_open(): disk has %u-byte blocks, at most %d are supported\n",
+	      sb.block_size, VDISK_MAX_BLOCK_SIZE);
+      return(-1);
+    }
+    if(sb.n_blocks < 2 || sb.n_blocks > VDISK_MAX_BLOCKS) {
+      fprintf(stderr, "vdisk_disk_open(): bad superblock (%u blocks)\n", sb.n_blocks);
+      return(-1);
+    }
+    vdisk_superblock = sb;
+    return(0);
+  }
+
+  // No superblock: the original geometry
+  memset(&vdisk_superblock, 0, sizeof(vdisk_superblock));
+  vdisk_superblock.block_size = VDISK_MIN_BLOCK_SIZE;
+  vdisk_superblock.n_blocks = N_BLOCKS_IN_DISK;
+  return(0);
+}
+
+/**
+ * Empty the file and give it the requested geometry, with the superblock
+ * in place and every other byte zero
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_create(int fd)
+{
+  memset(&vdisk_superblock, 0, sizeof(vdisk_superblock));
+  vdisk_superblock.magic = VDISK_MAGIC;
+  vdisk_superblock.block_size = requested_block_size;
+  vdisk_superblock.n_blocks = requested_blocks;
+  vdisk_superblock.n_inode_blocks = requested_inode_blocks;
+  requested_blocks = 0;
+
+  if(ftruncate(fd, 0) != 0
+     || ftruncate(fd, (off_t) vdisk_superblock.n_blocks * vdisk_superblock.block_size) != 0
+     || pwrite(fd, &vdisk_superblock, sizeof(vdisk_superblock),
+	       VDISK_SUPERBLOCK_OFFSET(vdisk_superblock.block_size))
+        != sizeof(vdisk_superblock)) {
+    fprintf(stderr, "vdisk_disk_open(): cannot create disk\n");
+    return(-1);
+  }
+  return(0);
+}
+
 /**
  * Open the virtual disk
  *
+ * The name may carry comma-separated options after the file name:
+ *   mmap      map the image into memory instead of using read/write
+ *   cache=N   cache N blocks (0 = no cache)
+ * e.g. ZDISK=vdisk1,mmap
+ *
  * @param virtual_disk_name Name of the file containing the virtual disk
  * @return 0 on success; < 0 on error
  *
@@ -28,23 +574,87 @@ int vdisk_disk_open(char *virtual_disk_name)
     return(-1);
   };
 
+  // Split the file name from the options
+  char name[strlen(virtual_disk_name) + 1];
+  strcpy(name, virtual_disk_name);
+  char *options = strchr(name, ',');
+  if(options != NULL)
+    *options++ = '\0';
+
+  int use_mmap = mmap_requested;
+  if(use_mmap < 0) {
+    char *str = getenv("ZDISK_MMAP");
+    use_mmap = (str != NULL && strcmp(str, "0") != 0);
+  }
+
+  char *save;
+  for(char *opt = (options == NULL) ? NULL : strtok_r(options, ",", &save); opt != NULL;
+      opt = strtok_r(NULL, ",", &save)) {
+    if(strcmp(opt, "mmap") == 0) {
+      use_mmap = 1;
+    }else if(strncmp(opt, "cache=", 6) == 0) {
+      vdisk_set_cache_size(atoi(opt + 6));
+    }else{
+      fprintf(stderr, "vdisk_disk_open(): unknown option (%s)\n", opt);
+      return(-1);
+    }
+  }
+
   // Open file
-  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
+  int fd = open(name, O_RDWR | O_CREAT,
 		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
   // Check code
   if(fd <= 0) {
-    fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
+    fprintf(stderr, "Unable to open virtual disk (%s)\n", name);
     return(-1);
   };
 
+  // Geometry: new, or from the superblock
+  int ret = (requested_blocks > 0) ? vdisk_create(fd) : vdisk_read_superblock(fd);
+  if(ret != 0) {
+    close(fd);
+    return(ret);
+  }
+  vdisk_blocks = vdisk_superblock.n_blocks;
+  vdisk_block_bytes = vdisk_superblock.block_size;
+  vdisk_block_shift = __builtin_ctz(vdisk_block_bytes);
+  cache_map = malloc(vdisk_blocks * sizeof(int));
+  if(cache_map == NULL) {
+    fprintf(stderr, "Unable to allocate the block map (%d blocks)\n", vdisk_blocks);
+    close(fd);
+    return(-1);
+  }
+
+  memset(&vdisk_stats, 0, sizeof(vdisk_stats));
+
+  if(use_mmap) {
+    // The mapping replaces the block cache
+    for(int i = 0; i < vdisk_blocks; ++i)
+      cache_map[i] = NO_SLOT;
+    cache_size = 0;
+    ret = vdisk_map_image(fd);
+  }else{
+    // Start with an empty cache
+    ret = cache_init();
+  }
+  if(ret != 0) {
+    free(cache_map);
+    cache_map = NULL;
+    close(fd);
+    return(-1);
+  }
+
   // Remember the fd in the global variable
   vdisk_fd = fd;
   return(0);
 };
 
 /**
- * Close the virtual disk
+ * Close the virtual disk.  Dirty cached blocks are written back first.
+ *
+ * If the ZDISK_STATS environment variable is set, the cache counters are
+ * reported on stderr.
  *
  * @return 0 on success; <0 for an error
  */
@@ -56,12 +666,46 @@ int vdisk_disk_close()
     exit(-1);
   };
 
+  int ret = 0;
+
+  // Let the layers above write back first
+  if(vdisk_close_hook != NULL) {
+    int (*hook)() = vdisk_close_hook;
+    vdisk_close_hook = NULL;
+    ret = hook();
+  }
+
+  int flush_ret = vdisk_flush();
+  if(ret == 0)
+    ret = flush_ret;
+
+  if(getenv("ZDISK_STATS") != NULL) {
+    fprintf(stderr, "vdisk: %lu hits, %lu misses, %lu host reads, %lu host writes, %lu host calls, %lu evictions\n",
+	    vdisk_stats.hits, vdisk_stats.misses, vdisk_stats.host_reads,
+	    vdisk_stats.host_writes, vdisk_stats.host_calls, vdisk_stats.evictions);
+  }
+
+  // Drop the cache or the mapping
+  free(cache_slots);
+  free(cache_data);
+  cache_slots = NULL;
+  cache_data = NULL;
+  cache_size = 0;
+  if(vdisk_map != NULL) {
+    munmap(vdisk_map, (size_t) vdisk_blocks << vdisk_block_shift);
+    vdisk_map = NULL;
+  }
+  free(cache_map);
+  cache_map = NULL;
+  vdisk_blocks = 0;
+  vdisk_block_bytes = 0;
+
   // Close the file
   close(vdisk_fd);
 
   // Mark as closed
   vdisk_fd = 0;
-  return(0);
+  return(ret);
 }
 
 /**
@@ -84,23 +728,44 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
   };
 
   // Make sure that we have a valid block request
-  if(block_ref >= N_BLOCKS_IN_DISK) {
+  if(block_ref >= vdisk_blocks) {
     fprintf(stderr, "vdisk_read_block(): bad block_ref(%d)\n", block_ref);
     return(-2);
   }
 
-  // Lsek to the correct point in the file
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return(-3);
+  // Mapped image: just copy
+  if(vdisk_map != NULL) {
+    vdisk_copy_block(block, vdisk_map + ((size_t) block_ref << vdisk_block_shift), vdisk_block_bytes);
+    return(0);
   }
 
-  // Read the block
-  if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_read_block(): read failed\n");
-    return(-4);
+  // No cache: straight to the file
+  if(cache_size == 0) {
+    ++vdisk_stats.misses;
+    return(vdisk_host_read(block_ref, block));
   }
 
+  // Cached?
+  int slot = cache_map[block_ref];
+  if(slot != NO_SLOT) {
+    ++vdisk_stats.hits;
+    cache_touch(slot);
+  }else{
+    ++vdisk_stats.misses;
+    slot = cache_claim(block_ref);
+    if(slot < 0)
+      return(slot);
+    int ret = vdisk_host_read(block_ref, cache_slots[slot].data);
+    if(ret != 0) {
+      // Do not leave garbage behind
+      cache_slots[slot].valid = 0;
+      cache_map[block_ref] = NO_SLOT;
+      return(ret);
+    }
+  }
+
+  vdisk_copy_block(block, cache_slots[slot].data, vdisk_block_bytes);
+
   // Success
   return(0);
 }
@@ -124,23 +789,207 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
   };
 
   // Is it a valid block request?
-  if(block_ref >= N_BLOCKS_IN_DISK) {
+  if(block_ref >= vdisk_blocks) {
     fprintf(stderr, "vdisk_write_block(): bad block_ref(%d)\n", block_ref);
     return(-2);
   }
 
-  // Move to the beginning of the block
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return(-3);
+  // Mapped image: just copy
+  if(vdisk_map != NULL) {
+    vdisk_copy_block(vdisk_map + ((size_t) block_ref << vdisk_block_shift), block, vdisk_block_bytes);
+    return(0);
   }
 
-  // Read the block
-  if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_write_block(): read failed\n");
-    return(-4);
+  // No cache: straight to the file
+  if(cache_size == 0)
+    return(vdisk_host_write(block_ref, block));
+
+  // The whole block is replaced, so a miss does not need to read the file
+  int slot = cache_map[block_ref];
+  if(slot != NO_SLOT) {
+    cache_touch(slot);
+  }else{
+    slot = cache_claim(block_ref);
+    if(slot < 0)
+      return(slot);
   }
 
+  vdisk_copy_block(cache_slots[slot].data, block, vdisk_block_bytes);
+  cache_slots[slot].dirty = 1;
+
   // Success
   return(0);
 }
+
+/**
+ * Check a list of block references
+ *
+ * @return 0 if all are on the disk; -2 otherwise
+ */
+static int vdisk_check_refs(char *caller, BLOCK_REFERENCE *block_refs, int n_blocks)
+{
+  for(int i = 0; i < n_blocks; ++i) {
+    if(block_refs[i] >= vdisk_blocks) {
+      fprintf(stderr, "%s(): bad block_ref(%d)\n", caller, block_refs[i]);
+      return(-2);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Length of the run starting at block_refs[start]: entries whose block
+ * numbers follow each other on disk, none of them cached
+ */
+static int vdisk_run_length(BLOCK_REFERENCE *block_refs, int start, int n_blocks)
+{
+  int len = 1;
+  while(start + len < n_blocks && len < VDISK_MAX_RUN
+	&& block_refs[start + len] == block_refs[start] + len
+	&& (cache_size == 0 || cache_map[block_refs[start + len]] == NO_SLOT))
+    ++len;
+  return(len);
+}
+
+/**
+ *  Read a list of disk blocks.  Blocks that are not cached are fetched
+ *  with one preadv() per run of adjacent block numbers.
+ *
+ * @param block_refs Blocks to read
+ * @param n_blocks Number of entries in block_refs
+ * @param blocks Buffer of n_blocks blocks, back to back: block i goes to
+ *               offset i * vdisk_block_size()
+ * @return 0 on success; <0 on error
+ */
+int vdisk_read_blocks(BLOCK_REFERENCE *block_refs, int n_blocks, void *blocks)
+{
+  unsigned char *buf = blocks;
+  struct iovec iov[VDISK_MAX_RUN];
+
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_read_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  int ret = vdisk_check_refs("vdisk_read_blocks", block_refs, n_blocks);
+  if(ret != 0)
+    return(ret);
+
+  if(vdisk_map != NULL) {
+    for(int i = 0; i < n_blocks; ++i)
+      vdisk_copy_block(buf + ((size_t) i << vdisk_block_shift),
+		       vdisk_map + ((size_t) block_refs[i] << vdisk_block_shift), vdisk_block_bytes);
+    return(0);
+  }
+
+  // Cached blocks are copied out; the others are fetched run by run.
+  //  Caching a fetched run may evict a block that comes later in the list,
+  //  but eviction writes it back first, so the later fetch still sees it.
+  for(int i = 0; i < n_blocks; ) {
+    int slot = (cache_size == 0) ? NO_SLOT : cache_map[block_refs[i]];
+    if(slot != NO_SLOT) {
+      ++vdisk_stats.hits;
+      cache_touch(slot);
+      vdisk_copy_block(buf + ((size_t) i << vdisk_block_shift), cache_slots[slot].data,
+		       vdisk_block_bytes);
+      ++i;
+      continue;
+    }
+
+    int len = vdisk_run_length(block_refs, i, n_blocks);
+    for(int j = 0; j < len; ++j) {
+      iov[j].iov_base = buf + ((size_t) (i + j) << vdisk_block_shift);
+      iov[j].iov_len = vdisk_block_bytes;
+    }
+    vdisk_stats.misses += len;
+    ret = vdisk_host_readv(block_refs[i], iov, len);
+    if(ret != 0)
+      return(ret);
+
+    // Keep a copy of what we just read
+    if(cache_size != 0) {
+      for(int j = 0; j < len; ++j) {
+	int slot = cache_claim(block_refs[i + j]);
+	if(slot < 0)
+	  return(slot);
+	vdisk_copy_block(cache_slots[slot].data, buf + ((size_t) (i + j) << vdisk_block_shift),
+			 vdisk_block_bytes);
+      }
+    }
+    i += len;
+  }
+
+  return(0);
+}
+
+/**
+ *  Write a list of disk blocks.  If the list fits in the cache, the blocks
+ *  are cached as dirty (and later flushed in runs).  Otherwise they are
+ *  written straight through with one pwritev() per run of adjacent block
+ *  numbers.
+ *
+ * @param block_refs Blocks to write
+ * @param n_blocks Number of entries in block_refs
+ * @param blocks Buffer of n_blocks blocks, back to back: block i comes from
+ *               offset i * vdisk_block_size()
+ * @return 0 on success; <0 on error
+ */
+int vdisk_write_blocks(BLOCK_REFERENCE *block_refs, int n_blocks, void *blocks)
+{
+  unsigned char *buf = blocks;
+  struct iovec iov[VDISK_MAX_RUN];
+
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_write_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  int ret = vdisk_check_refs("vdisk_write_blocks", block_refs, n_blocks);
+  if(ret != 0)
+    return(ret);
+
+  if(vdisk_map != NULL) {
+    for(int i = 0; i < n_blocks; ++i)
+      vdisk_copy_block(vdisk_map + ((size_t) block_refs[i] << vdisk_block_shift),
+		       buf + ((size_t) i << vdisk_block_shift), vdisk_block_bytes);
+    return(0);
+  }
+
+  // Small batch: let the cache absorb it
+  if(n_blocks <= cache_size) {
+    for(int i = 0; i < n_blocks; ++i) {
+      ret = vdisk_write_block(block_refs[i], buf + ((size_t) i << vdisk_block_shift));
+      if(ret != 0)
+	return(ret);
+    }
+    return(0);
+  }
+
+  // Large batch: cached copies are refreshed and become clean, the rest
+  //  goes straight to the file
+  for(int i = 0; i < n_blocks; ) {
+    int slot = (cache_size == 0) ? NO_SLOT : cache_map[block_refs[i]];
+    if(slot != NO_SLOT) {
+      vdisk_copy_block(cache_slots[slot].data, buf + ((size_t) i << vdisk_block_shift),
+		       vdisk_block_bytes);
+      cache_slots[slot].dirty = 0;
+      ret = vdisk_host_write(block_refs[i], cache_slots[slot].data);
+      if(ret != 0)
+	return(ret);
+      ++i;
+      continue;
+    }
+
+    int len = vdisk_run_length(block_refs, i, n_blocks);
+    for(int j = 0; j < len; ++j) {
+      iov[j].iov_base = buf + ((size_t) (i + j) << vdisk_block_shift);
+      iov[j].iov_len = vdisk_block_bytes;
+    }
+    ret = vdisk_host_writev(block_refs[i], iov, len);
+    if(ret != 0)
+      return(ret);
+    i += len;
+  }
+
+  return(0);
+}
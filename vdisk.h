@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -6,18 +7,136 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <string.h>
 
-typedef unsigned short BLOCK_REFERENCE;
+typedef unsigned int BLOCK_REFERENCE;
 
-// Size of block in bytes
-#define BLOCK_SIZE 256 
+// Block sizes a disk may have: powers of two from VDISK_MIN_BLOCK_SIZE to
+//  VDISK_MAX_BLOCK_SIZE.  Each disk records its own in its superblock
+//  (vdisk_block_size() gives the one of the open disk); buffers for a
+//  block are VDISK_MAX_BLOCK_SIZE bytes, so that one build handles them all
+#define VDISK_MIN_BLOCK_SIZE 256
+#ifndef VDISK_MAX_BLOCK_SIZE
+#define VDISK_MAX_BLOCK_SIZE 4096
+#endif
+#if VDISK_MAX_BLOCK_SIZE < VDISK_MIN_BLOCK_SIZE || (VDISK_MAX_BLOCK_SIZE & (VDISK_MAX_BLOCK_SIZE - 1)) != 0
+#error "VDISK_MAX_BLOCK_SIZE must be a power of two, at least 256"
+#endif
+#define VDISK_BLOCK_SIZE_OK(size) \
+  ((size) >= VDISK_MIN_BLOCK_SIZE && (size) <= VDISK_MAX_BLOCK_SIZE && ((size) & ((size) - 1)) == 0)
+
+// Block size of new disks, unless the caller asks for another one (make
+//  BLOCK_SIZE=4096 changes the default)
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 256
+#endif
+#if !VDISK_BLOCK_SIZE_OK(BLOCK_SIZE)
+#error "BLOCK_SIZE must be a power of two from 256 to VDISK_MAX_BLOCK_SIZE"
+#endif
 
-// Total number of blocks on the virtual disk
+// Total number of blocks on a virtual disk without a superblock
 #define N_BLOCKS_IN_DISK 128
 
+// Most blocks a virtual disk can have (the file system may allow fewer:
+//  see OUFS_NARROW_MAX_BLOCKS)
+#define VDISK_MAX_BLOCKS INT_MAX
+
+// Superblock: the geometry of a virtual disk, kept in the last bytes of
+//  block 0.  Disks formatted before superblocks existed have none, and
+//  read as N_BLOCKS_IN_DISK blocks of VDISK_MIN_BLOCK_SIZE bytes.
+#define VDISK_MAGIC 0x5346554f
+#define VDISK_SUPERBLOCK_OFFSET(block_size) ((block_size) - sizeof(VDISK_SUPERBLOCK))
+
+typedef struct vdisk_superblock_s
+{
+  // VDISK_MAGIC
+  unsigned int magic;
+
+  unsigned int block_size;
+  unsigned int n_blocks;
+
+  // Blocks of inodes following block 0 (0 = the file system's default)
+  unsigned int n_inode_blocks;
+} VDISK_SUPERBLOCK;
+
+/**
+ * Copy one block.  The usual block sizes get a copy of constant length,
+ * which the compiler expands inline; any other size is a plain memcpy().
+ *
+ * @param dst where the block goes
+ * @param src where it comes from
+ * @param block_size bytes in a block (vdisk_block_size())
+ */
+static inline void vdisk_copy_block(void *dst, const void *src, int block_size)
+{
+  switch(block_size) {
+  case 256: memcpy(dst, src, 256); break;
+  case 512: memcpy(dst, src, 512); break;
+  case 1024: memcpy(dst, src, 1024); break;
+  case 4096: memcpy(dst, src, 4096); break;
+  default: memcpy(dst, src, block_size);
+  }
+}
+
+/**
+ * Set every byte of a block, dispatched like vdisk_copy_block()
+ *
+ * @param block block to fill
+ * @param value byte value
+ * @param block_size bytes in a block (vdisk_block_size())
+ */
+static inline void vdisk_fill_block(void *block, int value, int block_size)
+{
+  switch(block_size) {
+  case 256: memset(block, value, 256); break;
+  case 512: memset(block, value, 512); break;
+  case 1024: memset(block, value, 1024); break;
+  case 4096: memset(block, value, 4096); break;
+  default: memset(block, value, block_size);
+  }
+}
+
+// Number of blocks held by the block cache when neither ZDISK_CACHE nor
+//  vdisk_set_cache_size() says otherwise
+#define VDISK_DEFAULT_CACHE_BLOCKS 32
+
+// Counters kept by the block cache
+typedef struct vdisk_stats_s
+{
+  // Block reads served from the cache
+  unsigned long hits;
+
+  // Block reads that had to go to the host file
+  unsigned long misses;
+
+  // Blocks read from / written to the host file
+  unsigned long host_reads;
+  unsigned long host_writes;
+
+  // System calls made on the host file (one call may move several blocks)
+  unsigned long host_calls;
+
+  // Dirty blocks written back because they were evicted
+  unsigned long evictions;
+} VDISK_STATS;
+
 int vdisk_disk_open(char *virtual_disk_name);
+int vdisk_set_geometry(int n_blocks, int n_inode_blocks, int block_size);
+void vdisk_get_superblock(VDISK_SUPERBLOCK *superblock);
+int vdisk_n_blocks();
+int vdisk_block_size();
 int vdisk_disk_close();
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(BLOCK_REFERENCE *block_refs, int n_blocks, void *blocks);
+int vdisk_write_blocks(BLOCK_REFERENCE *block_refs, int n_blocks, void *blocks);
+
+// Block cache and backend selection
+int vdisk_set_cache_size(int n_blocks);
+int vdisk_set_mmap(int on);
+int vdisk_flush();
+void vdisk_set_close_hook(int (*hook)());
+void vdisk_get_stats(VDISK_STATS *stats);
 
 #endif
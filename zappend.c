@@ -9,6 +9,9 @@ CS3113
 #include <string.h>
 #include "oufs_lib.h"
 
+// Bytes read from stdin at a time
+#define COPY_CHUNK (64 * 1024)
+
 int main(int argc, char** argv) {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
@@ -23,15 +26,16 @@ int main(int argc, char** argv) {
     // Open file for reading
     OUFILE *fp = oufs_fopen(strdup(cwd), strdup(argv[1]), "a");
 
-    // Read byte by byte from stdin
-    unsigned char ch;
-    while (read(STDIN_FILENO, &ch, 1) > 0)
+    // Read stdin a chunk at a time
+    static unsigned char buf[COPY_CHUNK];
+    ssize_t got;
+    while ((got = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
     {
-      // Attempt to write the byte to the file
-      int wrote = oufs_fwrite(fp, &ch, 1);
+      // Attempt to write the whole chunk to the file
+      int wrote = oufs_fwrite(fp, buf, got);
 
-      // Break the loop if we failed to write the byte. This means the file is full
-      if (wrote == 0)
+      // Break the loop if we failed to write all of it. This means the file is full
+      if (wrote < got)
         break;
     }
 
@@ -0,0 +1,218 @@
+/**
+Micro-benchmarks for the OU File System library.
+
+Builds a scratch disk (ZBENCH_DISK, default zbench.img -- it is formatted!)
+and reports how many blocks the host file sees per operation, along with
+the time per operation.
+
+Usage: zbench [lookup|append]
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "oufs_lib.h"
+
+// Directory levels below the root used by the lookup benchmark (each one
+//  uses a directory worth of inodes)
+#define LOOKUP_DEPTH 3
+
+// Repetitions used for timing
+#define LOOKUP_REPEAT 20000
+#define APPEND_REPEAT 200
+
+// File sizes used by the append benchmark, in blocks
+#define APPEND_BLOCKS 15
+
+/**
+ * Current time in nanoseconds
+ */
+static double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Blocks read from the host file so far in this session
+ */
+static unsigned long host_reads()
+{
+  VDISK_STATS stats;
+  vdisk_get_stats(&stats);
+  return stats.host_reads;
+}
+
+/**
+ * Blocks written to the host file so far in this session
+ */
+static unsigned long host_writes()
+{
+  VDISK_STATS stats;
+  vdisk_get_stats(&stats);
+  return stats.host_writes;
+}
+
+/**
+ * Path lookups through full directories.  Each level holds one directory
+ * block's worth of entries, less 3, of files and then the next directory,
+ * so every level is a full directory whose interesting entry is the last
+ * one.
+ */
+static void bench_lookup(char *disk_name)
+{
+  char path[MAX_PATH_LENGTH] = "";
+  char name[MAX_PATH_LENGTH];
+
+  // Build the tree
+  OUFS_GEOMETRY geometry;
+  oufs_format_disk(disk_name);
+  vdisk_disk_open(disk_name);
+  oufs_get_geometry(&geometry);
+  for (int level = 0; level < LOOKUP_DEPTH; level++)
+  {
+    for (int i = 0; i < geometry.entries_per_block - 3; i++)
+    {
+      if (snprintf(name, sizeof(name), "%s/file%d", path, i) >= (int) sizeof(name))
+      {
+        fprintf(stderr, "zbench: lookup path too long\n");
+        vdisk_disk_close();
+        return;
+      }
+      oufs_touch("/", name);
+    }
+    if (snprintf(name, sizeof(name), "%s/dir%d", path, level) >= (int) sizeof(name))
+    {
+      fprintf(stderr, "zbench: lookup path too long\n");
+      vdisk_disk_close();
+      return;
+    }
+    oufs_mkdir("/", name);
+    strcpy(path, name);
+  }
+  vdisk_disk_close();
+
+  // Measure with the block cache off, so that every block read is a host read
+  vdisk_set_cache_size(0);
+  vdisk_disk_open(disk_name);
+
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  char local_name[FILE_NAME_SIZE];
+
+  // Bring in the resident tables first; they are not part of a lookup
+  oufs_find_file("/", "/", &parent, &child, local_name);
+
+  // Cold lookups: nothing cached above the disk
+  unsigned long reads = host_reads();
+  double start = now_ns();
+  for (int i = 0; i < LOOKUP_REPEAT; i++)
+  {
+    oufs_dentry_reset();
+    oufs_find_file("/", path, &parent, &child, local_name);
+  }
+  double cold_ns = (now_ns() - start) / LOOKUP_REPEAT;
+  double cold_reads = (double) (host_reads() - reads) / LOOKUP_REPEAT;
+
+  // Warm lookups: every component is in the dentry cache
+  reads = host_reads();
+  start = now_ns();
+  for (int i = 0; i < LOOKUP_REPEAT; i++)
+    oufs_find_file("/", path, &parent, &child, local_name);
+  double warm_ns = (now_ns() - start) / LOOKUP_REPEAT;
+  double warm_reads = (double) (host_reads() - reads) / LOOKUP_REPEAT;
+
+  vdisk_disk_close();
+
+  printf("lookup: %d full directories deep\n", LOOKUP_DEPTH);
+  printf("  cold: %6.2f block reads/lookup  %8.0f ns/lookup\n", cold_reads, cold_ns);
+  printf("  warm: %6.2f block reads/lookup  %8.0f ns/lookup\n", warm_reads, warm_ns);
+}
+
+/**
+ * One-byte appends to files of growing size.  Each append is a full
+ * open / write / close cycle; the cost of an append should not depend on
+ * how large the file already is.
+ */
+static void bench_append(char *disk_name)
+{
+  // File sizes step by one block of the disk the benchmark formats
+  OUFS_GEOMETRY geometry;
+  oufs_format_disk(disk_name);
+  vdisk_disk_open(disk_name);
+  oufs_get_geometry(&geometry);
+  vdisk_disk_close();
+
+  int max_size = APPEND_BLOCKS * geometry.block_size;
+  unsigned char *data = malloc(max_size);
+  if (data == NULL)
+  {
+    fprintf(stderr, "zbench: out of memory\n");
+    return;
+  }
+  memset(data, 'x', max_size);
+
+  // Measure with the block cache off, so that every block access is a host access
+  vdisk_set_cache_size(0);
+  printf("append: 1 byte, open/write/close\n");
+
+  // Leave room for APPEND_REPEAT bytes after the largest starting size
+  for (int size = 0; size + APPEND_REPEAT <= max_size; size += geometry.block_size)
+  {
+    oufs_format_disk(disk_name);
+    vdisk_disk_open(disk_name);
+
+    // Build the file; this also brings in the resident tables
+    OUFILE *fp = oufs_fopen("/", "/file", "w");
+    oufs_fwrite(fp, data, size);
+    oufs_fclose(fp);
+
+    unsigned long reads = host_reads();
+    unsigned long writes = host_writes();
+    double start = now_ns();
+    for (int i = 0; i < APPEND_REPEAT; i++)
+    {
+      fp = oufs_fopen("/", "/file", "a");
+      oufs_fwrite(fp, data, 1);
+      oufs_fclose(fp);
+    }
+    double append_ns = (now_ns() - start) / APPEND_REPEAT;
+    double append_reads = (double) (host_reads() - reads) / APPEND_REPEAT;
+    double append_writes = (double) (host_writes() - writes) / APPEND_REPEAT;
+
+    vdisk_disk_close();
+
+    printf("  %5d bytes: %6.2f block reads/append  %6.2f block writes/append  %8.0f ns/append\n",
+           size, append_reads, append_writes, append_ns);
+  }
+  free(data);
+}
+
+int main(int argc, char** argv)
+{
+  char *disk_name = getenv("ZBENCH_DISK");
+  if (disk_name == NULL)
+    disk_name = "zbench.img";
+
+  if (argc == 1)
+  {
+    bench_lookup(disk_name);
+    bench_append(disk_name);
+  }
+  else if (!strcmp(argv[1], "lookup"))
+    bench_lookup(disk_name);
+  else if (!strcmp(argv[1], "append"))
+    bench_append(disk_name);
+  else
+  {
+    // Wrong parameters
+    fprintf(stderr, "Usage: zbench [lookup|append]\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,22 +1,76 @@
+/**
+List a directory of the OU File System.
+
+Usage: zfilez [-l] [<path>]
+
+With -l, each entry is listed with its type, link count and size (bytes
+for a file, entries for a directory).
+
+*/
+
 #include "oufs_lib.h"
 
-int main(int argc, char** argv) 
+/**
+ * Print one entry in long format
+ * @param stat attributes of the entry
+ */
+static void print_long(OUFS_STAT *stat)
+{
+  printf("%c %3d %8u %s%s\n", stat->type, stat->n_references, stat->size,
+         stat->name, (stat->type == IT_DIRECTORY) ? "/" : "");
+}
+
+int main(int argc, char** argv)
 {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
 
+  // Check arguments
+  int long_format = (argc >= 2 && !strcmp(argv[1], "-l"));
+  if (argc > 2 + long_format) {
+    fprintf(stderr, "Usage: zfilez [-l] [<path>]\n");
+    return 1;
+  }
+
+  // No path supplied, use cwd
+  char *path = (argc == 1 + long_format) ? "" : argv[1 + long_format];
+
   // Open virtual disk
   vdisk_disk_open(disk_name);
 
-  if (argc == 1)
-    // No path supplied, use cwd
-    oufs_list(strdup(cwd), "");
+  if (long_format)
+  {
+    // Every entry's attributes in one call
+    OUFS_STAT *stats;
+    OUFS_STAT stat;
+    int n = oufs_stat_dir(cwd, path, &stats);
+    if (n >= 0)
+    {
+      for (int i = 0; i < n; i++)
+        print_long(&stats[i]);
+      free(stats);
+    }
+    else if (oufs_stat(cwd, path, &stat) == 0)
+      print_long(&stat);
+  }
   else
   {
-    // Path is supplied, so send both the path amd the cwd
-    oufs_list(strdup(cwd), strdup(argv[1]));
+    // Stream the entries of a directory in the order they are stored
+    OUFS_DIR *dir = oufs_opendir(cwd, path);
+    if (dir != NULL)
+    {
+      OUFS_DIRENT *dirent;
+      while ((dirent = oufs_readdir(dir)) != NULL)
+        printf("%s%s\n", dirent->name, (dirent->type == IT_DIRECTORY) ? "/" : "");
+      oufs_closedir(dir);
+    }
+    else
+    {
+      // Not a directory: a file is listed by name
+      oufs_list(cwd, path);
+    }
   }
 
   // Close vdisk
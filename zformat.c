@@ -1,14 +1,78 @@
+/**
+Format a virtual disk for the OU File System.
+
+Usage: zformat [-w] [-b <block size>] [-n <blocks>] [-i <inodes>]
+
+-b gives the size of a block in bytes, a power of two from
+VDISK_MIN_BLOCK_SIZE to VDISK_MAX_BLOCK_SIZE (default BLOCK_SIZE).  It is
+recorded in the superblock, so every tool opens the disk with it.  Without
+-n and -i the disk has N_BLOCKS_IN_DISK blocks and N_INODE_BLOCKS blocks of
+inodes.
+
+-w stores 32-bit block and inode references (OUFS_FORMAT_WIDE), so that
+the disk may have more than OUFS_NARROW_MAX_BLOCKS blocks.  Names are then
+at most WIDE_FILE_NAME_SIZE-1 characters long.
+
+*/
+
+#include <string.h>
+#include <limits.h>
 #include "oufs_lib.h"
 #include "vdisk.h"
 
-int main()
+/**
+ * Parse a positive count
+ * @param str text to parse
+ * @param value where to put the count
+ * @return 1 if str is a valid count, 0 otherwise
+ */
+static int parse_count(char *str, int *value)
+{
+  char *end;
+  long n = strtol(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || n <= 0 || n > INT_MAX)
+    return 0;
+  *value = n;
+  return 1;
+}
+
+int main(int argc, char** argv)
 {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
-  
-  oufs_format_disk(disk_name);
+
+  // Check arguments
+  int block_size = BLOCK_SIZE;
+  int n_blocks = N_BLOCKS_IN_DISK;
+  int n_inodes = 0;
+  int wide = 0;
+  for (int i = 1; i < argc; i++) {
+    int ok = 1;
+    if (!strcmp(argv[i], "-w"))
+      wide = 1;
+    else if (i + 1 < argc && !strcmp(argv[i], "-b"))
+      ok = parse_count(argv[++i], &block_size);
+    else if (i + 1 < argc && !strcmp(argv[i], "-n"))
+      ok = parse_count(argv[++i], &n_blocks);
+    else if (i + 1 < argc && !strcmp(argv[i], "-i"))
+      ok = parse_count(argv[++i], &n_inodes);
+    else
+      ok = 0;
+
+    if (!ok) {
+      fprintf(stderr, "Usage: zformat [-w] [-b <block size>] [-n <blocks>] [-i <inodes>]\n");
+      return 1;
+    }
+  }
+
+  if (n_inodes == 0 && VDISK_BLOCK_SIZE_OK(block_size))
+    n_inodes = N_INODE_BLOCKS * (wide ? WIDE_INODES_PER_BLOCK(block_size)
+                                      : INODES_PER_BLOCK(block_size));
+
+  if (oufs_format_disk_geometry(disk_name, n_blocks, n_inodes, block_size, wide) != 0)
+    return 1;
 
   return 0;
-}
\ No newline at end of file
+}
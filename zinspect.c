@@ -3,6 +3,27 @@
 
 #include "oufs_lib.h"
 
+/**
+ * Fetch the block references of an inode as they are stored on disk (16 or
+ * 32 bits wide), rather than as the library widens them
+ *
+ * @param geometry layout of the disk
+ * @param index inode reference
+ * @param data filled in with BLOCKS_PER_INODE references
+ */
+static void stored_references(OUFS_GEOMETRY *geometry, int index, unsigned int *data)
+{
+  BLOCK block;
+  int element = index % geometry->inodes_per_block;
+  vdisk_read_block(1 + index / geometry->inodes_per_block, &block);
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    if(geometry->wide)
+      data[i] = block.wide_inodes.inode[element].data[i];
+    else
+      data[i] = block.inodes.inode[element].data[i];
+  }
+}
+
 int main(int argc, char** argv) {
   // Get the key environment variables
   char cwd[MAX_PATH_LENGTH];
@@ -13,23 +34,37 @@ int main(int argc, char** argv) {
     return(-1);
   }
 
+  // Sizes of this disk
+  OUFS_GEOMETRY geometry;
+  if(oufs_get_geometry(&geometry) != 0) {
+    fprintf(stderr, "Error reading master block\n");
+    vdisk_disk_close();
+    return(-1);
+  }
+
   if(argc == 2){
     if(strncmp(argv[1], "-master", 8) == 0) {
-      // Master record
-      BLOCK block;
-      if(vdisk_read_block(0, &block) != 0) {
-	fprintf(stderr, "Error reading master block\n");
-      }else{
-	// Block read: report state
-	printf("Inode table:\n");
-	for(int i = 0; i < INODES_PER_BLOCK *  N_INODE_BLOCKS / 8; ++i) {
-	  printf("%02x\n", block.master.inode_allocated_flag[i]);
-	}
-	printf("Block table:\n");
-	for(int i = 0; i < N_BLOCKS_IN_DISK / 8; ++i) {
-	  printf("%02x\n", block.master.block_allocated_flag[i]);
-	}
+      // Master record: report state
+      printf("Inode table:\n");
+      for(int i = 0; i < geometry.n_inodes / 8; ++i) {
+	printf("%02x\n", geometry.inode_bitmap[i]);
       }
+      printf("Block table:\n");
+      for(int i = 0; i < geometry.n_blocks / 8; ++i) {
+	printf("%02x\n", geometry.block_bitmap[i]);
+      }
+
+    }else if(strncmp(argv[1], "-super", 7) == 0) {
+      // Superblock
+      VDISK_SUPERBLOCK superblock;
+      vdisk_get_superblock(&superblock);
+      printf("Superblock: %s\n", (superblock.magic == VDISK_MAGIC) ? "yes" : "no");
+      printf("Block size: %u\n", superblock.block_size);
+      printf("Blocks: %d\n", geometry.n_blocks);
+      printf("Inode blocks: %d\n", geometry.n_inode_blocks);
+      printf("Inodes: %d\n", geometry.n_inodes);
+      printf("Bitmap blocks: %d\n", geometry.n_bitmap_blocks);
+      printf("References: %d bits\n", geometry.wide ? 32 : 16);
       
     }else{
       fprintf(stderr, "Unknown argument (%s)\n", argv[1]);
@@ -40,16 +75,18 @@ int main(int argc, char** argv) {
       // Inode query
       int index;
       if(sscanf(argv[2], "%d", &index) == 1){
-	if(index < 0 || index >= N_INODES) {
+	if(index < 0 || index >= geometry.n_inodes) {
 	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
 	}else{
 	  INODE inode;
+	  unsigned int data[BLOCKS_PER_INODE];
 	  oufs_read_inode_by_reference(index, &inode);
+	  stored_references(&geometry, index, data);
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
 	  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
-	    printf("Block %d: %d\n", i, inode.data[i]);
+	    printf("Block %d: %u\n", i, data[i]);
 	  }
 	  printf("Size: %d\n", inode.size);
 	  
@@ -61,17 +98,19 @@ int main(int argc, char** argv) {
       // Extended Inode query
       int index;
       if(sscanf(argv[2], "%d", &index) == 1){
-	if(index < 0 || index >= N_INODES) {
+	if(index < 0 || index >= geometry.n_inodes) {
 	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
 	}else{
 	  INODE inode;
+	  unsigned int data[BLOCKS_PER_INODE];
 	  oufs_read_inode_by_reference(index, &inode);
+	  stored_references(&geometry, index, data);
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
 	  printf("N references: %d\n", inode.n_references);
 	  for(int i = 0; i < BLOCKS_PER_INODE; ++i) {
-	    printf("Block %d: %d\n", i, inode.data[i]);
+	    printf("Block %d: %u\n", i, data[i]);
 	  }
 	  printf("Size: %d\n", inode.size);
 	  
@@ -83,16 +122,16 @@ int main(int argc, char** argv) {
       // Inspect directory block
       int index;
       if(sscanf(argv[2], "%d", &index) == 1){
-	if(index < 0 || index >= N_BLOCKS_IN_DISK) {
+	if(index < 0 || index >= geometry.n_blocks) {
 	  fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
 	}else{
 	  BLOCK block;
 	  vdisk_read_block(index, &block);
 	  printf("Directory at block %d:\n", index);
-	  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-	    if(block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-	      printf("Entry %d: name=\"%s\", inode=%d\n", i, block.directory.entry[i].name,
-		     block.directory.entry[i].inode_reference);
+	  for(int i = 0; i < geometry.entries_per_block; ++i) {
+	    if(oufs_entry_inode(&block, i) != UNALLOCATED_INODE) {
+	      printf("Entry %d: name=\"%s\", inode=%u\n", i, block.directory.entry[i].name,
+		     oufs_entry_inode(&block, i));
 	    }
 	  }
 	}
@@ -101,13 +140,13 @@ int main(int argc, char** argv) {
       // Inspect raw block
       int index;
       if(sscanf(argv[2], "%d", &index) == 1){
-	if(index < 0 || index >= N_BLOCKS_IN_DISK) {
+	if(index < 0 || index >= geometry.n_blocks) {
 	  fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
 	}else{
 	  BLOCK block;
 	  vdisk_read_block(index, &block);
 	  printf("Raw data at block %d:\n", index);
-	  for(int i = 0; i < BLOCK_SIZE; ++i) {
+	  for(int i = 0; i < geometry.block_size; ++i) {
 	    if(block.data.data[i] >= ' ' && block.data.data[i] <= '~')
 	      printf("%3d: %02x %c\n", i, block.data.data[i], block.data.data[i]);
 	    else
@@ -1,5 +1,10 @@
 /**
-Make a directory in the OU File System.
+Print a file from the OU File System to stdout.
+
+Usage: zmore <filename> [<offset> [<length>]]
+
+With an offset, printing starts that many bytes into the file; with a
+length, at most that many bytes are printed.
 
 CS3113
 
@@ -7,50 +12,75 @@ CS3113
 
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include "oufs_lib.h"
 
+/**
+ * Parse a non-negative byte count
+ * @param str text to parse
+ * @param value where to put the count
+ * @return 1 if str is a valid count, 0 otherwise
+ */
+static int parse_count(char *str, int *value)
+{
+  char *end;
+  long n = strtol(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || n < 0 || n > INT_MAX)
+    return 0;
+  *value = n;
+  return 1;
+}
+
+/**
+ * Block callback: copy a piece of the file to stdout
+ * @return nonzero if stdout took fewer than len bytes
+ */
+static int write_stdout(const unsigned char *data, int len, void *arg)
+{
+  (void) arg;
+  // Stop reading once stdout stops taking data (e.g. a closed pipe)
+  return fwrite(data, 1, len, stdout) < (size_t) len;
+}
+
 int main(int argc, char** argv) {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
 
+  // Byte range to print; the default is the whole file
+  int offset = 0;
+  int remaining = INT_MAX;
+
   // Check arguments
-  if(argc == 2) {
+  if(argc >= 2 && argc <= 4
+     && (argc < 3 || parse_count(argv[2], &offset))
+     && (argc < 4 || parse_count(argv[3], &remaining))) {
     // Open the virtual disk
     vdisk_disk_open(disk_name);
 
     // Open file for reading
     OUFILE *fp = oufs_fopen(strdup(cwd), strdup(argv[1]), "r");
+    if (fp->inode_reference != (INODE_REFERENCE) -1)
+      oufs_fseek(fp, offset, SEEK_SET);
 
-    // Get file size
-    INODE inode;
-    oufs_read_inode_by_reference(fp->inode_reference, &inode);
-    int len = inode.size;
-    unsigned char buf[len];
-    
-    // Read the file
-    int ret = oufs_fread(fp, buf, len);
+    // Hand the file's blocks straight to stdout
+    int ret = oufs_fread_blocks(fp, remaining, write_stdout, NULL);
 
-    if (ret != -1) 
-    {
-      // Print it to stdout
-      printf("%.*s", len, buf);
-    }
-    else
+    if (ret == -1)
     {
       fprintf(stderr, "Error: (%d)\n", ret);
     }
-    
+
     // Close the file
     oufs_fclose(fp);
 
     // Clean up
     vdisk_disk_close();
-    
+
   }else{
     // Wrong number of parameters
-    fprintf(stderr, "Usage: zmore <filename>\n");
+    fprintf(stderr, "Usage: zmore <filename> [<offset> [<length>]]\n");
   }
 
 }